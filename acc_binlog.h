@@ -0,0 +1,81 @@
+#ifndef ACC_BINLOG_H
+#define ACC_BINLOG_H
+
+#include <stdint.h>
+
+/* Record layout of the AccountingLog binary log
+ *
+ * The log is a sequence of records in host byte order. Every record starts
+ * with a header and its size is a multiple of 8 bytes, including the
+ * header, so readers can skip record types they don't know.
+ *
+ * Every child writes the names of the metrics and the names of all servers
+ * before its first request records, so a log (or a rotated piece of it)
+ * can be decoded without the configuration that wrote it.
+ */
+#define ACC_BINLOG_MAGIC   0xACC1
+#define ACC_BINLOG_VERSION 1
+
+enum {
+	ACC_BINLOG_METRICS = 1,	/* acc_binlog_metrics */
+	ACC_BINLOG_SERVER  = 2,	/* acc_binlog_server */
+	ACC_BINLOG_REQUEST = 3,	/* acc_binlog_request */
+	ACC_BINLOG_CHILD   = 4	/* acc_binlog_child */
+};
+
+typedef struct {
+	uint16_t magic;
+	uint8_t  version;
+	uint8_t  type;
+	uint32_t size;
+} acc_binlog_header;
+
+/* Followed by count zero terminated names, in the order of the values of
+ * the request records */
+typedef struct {
+	acc_binlog_header header;
+	uint32_t          count;
+	uint32_t          length;	/* of the names, including the zeros */
+} acc_binlog_metrics;
+
+/* Followed by the zero terminated name of the server */
+typedef struct {
+	acc_binlog_header header;
+	uint32_t          id;
+	uint32_t          length;	/* of the name, including the zero */
+} acc_binlog_server;
+
+/* Followed by values measured values */
+typedef struct {
+	acc_binlog_header header;
+	uint64_t          timestamp;	/* end of the request, usec since epoch */
+	uint32_t          server;	/* id of an acc_binlog_server */
+	uint16_t          status;
+	uint16_t          values;
+	uint64_t          bytes;	/* bytes sent */
+} acc_binlog_request;
+
+/* Written when a child exits: the usage of the process since it was
+ * forked, and the sum of the usage of its requests, in microseconds.
+ * Sampled requests count by their weight. */
+typedef struct {
+	acc_binlog_header header;
+	uint64_t          timestamp;	/* exit, usec since epoch */
+	uint64_t          started;	/* child_init, usec since epoch */
+	uint32_t          pid;
+	uint32_t          reserved;
+	uint64_t          requests;
+	int64_t           utime;
+	int64_t           stime;
+	int64_t           cutime;	/* of its reaped children */
+	int64_t           cstime;
+	int64_t           request_utime;
+	int64_t           request_stime;
+	int64_t           request_cutime;
+	int64_t           request_cstime;
+	int64_t           maxrss;	/* kilobytes */
+} acc_binlog_child;
+
+#define ACC_BINLOG_ALIGN(size) ((((size) + 7) / 8) * 8)
+
+#endif /* ACC_BINLOG_H */
@@ -0,0 +1,365 @@
+/* Microbenchmark of the accounting hooks
+ *
+ * Includes the module itself, so its static hooks can be driven directly
+ * with synthetic request_rec chains: a plain request, one that's
+ * internally redirected, and one that runs a subrequest. The httpd
+ * functions the module calls are stubbed out in stubs.c; APR is the real
+ * thing. The system calls the module makes are counted through the
+ * linker's --wrap, see the Makefile.
+ *
+ * The trace scenarios only differ from base in a build with the traces
+ * compiled in, "make run TRACE=1": trace has AccountingTrace On below
+ * LogLevel debug, trace-debug at LogLevel debug (the messages are still
+ * dropped by the stubs, so that's the cost of formatting them).
+ *
+ * Usage: bench_hooks [iterations]
+ */
+#include "../mod_accounting.c"
+
+#include <apr_general.h>
+#include <stdio.h>
+
+/* Counted system calls */ // {{{
+enum {
+	SYS_GETRUSAGE,
+	SYS_CLOCK_GETTIME,
+	SYS_GETTIMEOFDAY,
+	SYS_PREAD,
+	SYS_OPEN,
+	SYS_WAIT4,
+	SYSCALLS
+};
+
+static const char *syscall_names[SYSCALLS] = {
+	"getrusage",
+	"clock_gettime",
+	"gettimeofday",
+	"pread",
+	"open",
+	"wait4"
+};
+
+static unsigned long syscalls[SYSCALLS];
+
+/* The log level of the stubs */
+extern int stub_loglevel;
+
+int __real_getrusage(int who, struct rusage *usage);
+int __real_clock_gettime(clockid_t id, struct timespec *ts);
+int __real_gettimeofday(struct timeval *tv, void *tz);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+int __real_open(const char *path, int flags, ...);
+pid_t __real_wait4(pid_t pid, int *status, int options, struct rusage *usage);
+
+int __wrap_getrusage(int who, struct rusage *usage){
+	syscalls[SYS_GETRUSAGE]++;
+	return __real_getrusage(who, usage);
+}
+
+int __wrap_clock_gettime(clockid_t id, struct timespec *ts){
+	syscalls[SYS_CLOCK_GETTIME]++;
+	return __real_clock_gettime(id, ts);
+}
+
+int __wrap_gettimeofday(struct timeval *tv, void *tz){
+	syscalls[SYS_GETTIMEOFDAY]++;
+	return __real_gettimeofday(tv, tz);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset){
+	syscalls[SYS_PREAD]++;
+	return __real_pread(fd, buf, count, offset);
+}
+
+int __wrap_open(const char *path, int flags, ...){
+	syscalls[SYS_OPEN]++;
+	return __real_open(path, flags, 0644);
+}
+
+pid_t __wrap_wait4(pid_t pid, int *status, int options, struct rusage *usage){
+	syscalls[SYS_WAIT4]++;
+	return __real_wait4(pid, status, options, usage);
+}
+// }}}
+
+/* The scenarios, each a variation of the default configuration
+ *
+ * Every request of a scenario is on the same connection, like a
+ * keep-alive connection. */ // {{{
+typedef struct {
+	const char *name;
+	void (*configure)(acc_server_conf *conf);
+	int loglevel;
+} bench_backend;
+
+static void conf_base(acc_server_conf *conf){ }
+static void conf_notes_off(acc_server_conf *conf){ conf->notes = 0; }
+static void conf_trace(acc_server_conf *conf){ conf->trace = 1; }
+static void conf_process(acc_server_conf *conf){ conf->cpu_source = ACC_CPU_PROCESS; }
+static void conf_coarse(acc_server_conf *conf){ conf->clock = ACC_CLOCK_COARSE; }
+static void conf_lean(acc_server_conf *conf){ conf->lean = 1; }
+static void conf_lean_connection(acc_server_conf *conf){ conf->lean = 1; conf->conn_snapshot = 1; }
+static void conf_connection(acc_server_conf *conf){ conf->conn_snapshot = 1; }
+static void conf_sampled(acc_server_conf *conf){ conf->sample_rate = 100; }
+static void conf_phases(acc_server_conf *conf){ conf->phases = 1; }
+static void conf_bytes(acc_server_conf *conf){ conf->bytes = 1; }
+static void conf_aggregate(acc_server_conf *conf){ conf->aggregate = 1; }
+static void conf_histograms(acc_server_conf *conf){ conf->aggregate = 1; conf->histograms = 1; }
+static void conf_hitters(acc_server_conf *conf){ conf->hitters = 1024; }
+static void conf_key(acc_server_conf *conf){ conf->aggregate = 1; conf->key_source = ACC_KEY_HEADER; conf->key_name = "X-Tenant"; }
+#ifdef ACC_POOL_BYTES
+static void conf_memory(acc_server_conf *conf){ conf->memory = 1; }
+#endif
+static void conf_subrequests(acc_server_conf *conf){ conf->subrequests = 16; }
+static void conf_thread_io(acc_server_conf *conf){ conf->thread_io = 1; }
+static void conf_binlog(acc_server_conf *conf){ conf->binlog_path = "/dev/null"; }
+
+static const bench_backend backends[] = {
+	{ "base",          conf_base },
+	{ "notes-off",     conf_notes_off },
+	{ "trace",         conf_trace },
+	{ "trace-debug",   conf_trace, APLOG_DEBUG },
+	{ "cpu-process",   conf_process },
+	{ "clock-coarse",  conf_coarse },
+	{ "connection",    conf_connection },
+	{ "lean",          conf_lean },
+	{ "lean-conn",     conf_lean_connection },
+	{ "sampled-1/100", conf_sampled },
+	{ "phases",        conf_phases },
+	{ "bytes",         conf_bytes },
+	{ "aggregate",     conf_aggregate },
+	{ "histograms",    conf_histograms },
+	{ "heavy-hitters", conf_hitters },
+	{ "key-header",    conf_key },
+#ifdef ACC_POOL_BYTES
+	{ "memory",        conf_memory },
+#endif
+	{ "subrequests",   conf_subrequests },
+	{ "thread-io",     conf_thread_io },
+	{ "binlog",        conf_binlog }
+};
+
+enum {
+	SHAPE_PLAIN,
+	SHAPE_REDIRECT,
+	SHAPE_SUBREQUEST,
+	SHAPES
+};
+
+static const char *shape_names[SHAPES] = {
+	"plain",
+	"redirect",
+	"subrequest"
+};
+// }}}
+
+static request_rec *make_request(apr_pool_t *p, server_rec *s, conn_rec *c, ap_conf_vector_t *dir_config, const char *uri){ // {{{
+	request_rec *r = apr_pcalloc(p, sizeof(request_rec));
+
+	r->pool = p;
+	r->server = s;
+	r->connection = c;
+	r->per_dir_config = dir_config;
+	r->request_config = apr_pcalloc(p, sizeof(void*));
+	r->notes = apr_table_make(p, 8);
+	r->subprocess_env = apr_table_make(p, 8);
+	r->headers_in = apr_table_make(p, 8);
+	apr_table_setn(r->headers_in, "X-Tenant", "customer-1");
+	r->headers_out = apr_table_make(p, 8);
+	r->err_headers_out = apr_table_make(p, 8);
+	r->request_time = apr_time_now();
+	r->method_number = M_GET;
+	r->status = HTTP_OK;
+	r->uri = (char*) uri;
+	r->handler = "default-handler";
+#if AP_MODULE_MAGIC_AT_LEAST(20111130, 0)
+	r->useragent_ip = "192.0.2.1";
+#endif
+
+	return r;
+} // }}}
+
+
+/* The response every request sends, through its output filters */
+static const char body[] = "<html><body>Hello, benchmark</body></html>\n";
+
+/* Requests whose bytes_out didn't match the body */
+static unsigned long miscounted;
+
+static void send_response(request_rec *r){ // {{{
+	apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(body, sizeof(body) - 1, bb->bucket_alloc));
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+
+	ap_pass_brigade(r->output_filters, bb);
+} // }}}
+
+
+/* The hooks of one request, in the order httpd runs them */
+static void run_phases(request_rec *r){ // {{{
+	module_accounting_translate(r);
+	module_accounting_map(r);
+	module_accounting_access(r);
+	module_accounting_fixups(r);
+	module_accounting_insert_filter(r);
+	module_accounting_handler(r);
+} // }}}
+
+
+static void run_request(apr_pool_t *parent, server_rec *s, conn_rec *c, ap_conf_vector_t *dir_config, int shape){ // {{{
+	apr_pool_t *p, *sp;
+	request_rec *r, *next, *sub;
+	ap_filter_t *f;
+	apr_int64_t bytes;
+
+	apr_pool_create(&p, parent);
+
+	r = make_request(p, s, c, dir_config, "/index.php");
+	module_accounting_create_request(r);
+	module_accounting_start(r);
+	module_accounting_budget(r);
+	run_phases(r);
+
+	/* Neither an internal redirect nor a subrequest is read, so they
+	 * skip post_read_request. A redirect inherits the protocol filters,
+	 * like ap_internal_redirect(), and sends the response instead. */
+	switch (shape)
+	{
+		case SHAPE_REDIRECT:
+			next = make_request(p, s, c, dir_config, "/index.php/redirected");
+			next->prev = r;
+			r->next = next;
+			next->output_filters = next->proto_output_filters = r->proto_output_filters;
+			for (f = next->proto_output_filters; f; f = f->next)
+				f->r = next;
+			module_accounting_create_request(next);
+			run_phases(next);
+			send_response(next);
+			break;
+
+		case SHAPE_SUBREQUEST:
+			apr_pool_create(&sp, p);
+			sub = make_request(sp, s, c, dir_config, "/include.html");
+			sub->main = r;
+			module_accounting_create_request(sub);
+			run_phases(sub);
+			apr_pool_destroy(sp);
+			send_response(r);
+			break;
+
+		default:
+			send_response(r);
+	}
+
+	/* httpd logs the first request, the module finds the rest */
+	module_accounting_stop(r);
+
+	if (acc_get_value(r, "bytes_out", &bytes) == OK && bytes != sizeof(body) - 1)
+		miscounted++;
+
+	apr_pool_destroy(p);
+} // }}}
+
+
+static void run_backend(apr_pool_t *parent, const bench_backend *backend, int iterations){ // {{{
+	apr_pool_t *p;
+	server_rec *s;
+	conn_rec *c;
+	ap_conf_vector_t *dir_config;
+	struct timespec begin, end;
+	unsigned long counted[SYSCALLS];
+	int shape, i, j;
+
+	for (shape = 0; shape < SHAPES; shape++)
+	{
+		apr_pool_create(&p, parent);
+
+		s = apr_pcalloc(p, sizeof(server_rec));
+		s->server_hostname = "bench.example.com";
+		s->port = 80;
+		s->module_config = apr_pcalloc(p, sizeof(void*));
+		ap_set_module_config(s->module_config, &accounting_module, create_server_config(p, s));
+		backend->configure(ap_get_module_config(s->module_config, &accounting_module));
+
+		stub_loglevel = backend->loglevel ? backend->loglevel : APLOG_EMERG;
+#if !AP_MODULE_MAGIC_AT_LEAST(20100606, 0)
+		s->loglevel = stub_loglevel;
+#endif
+
+		dir_config = apr_pcalloc(p, sizeof(void*));
+		ap_set_module_config(dir_config, &accounting_module, create_dir_config(p, NULL));
+
+		c = apr_pcalloc(p, sizeof(conn_rec));
+		c->pool = p;
+		c->base_server = s;
+		c->conn_config = apr_pcalloc(p, sizeof(void*));
+#if !AP_MODULE_MAGIC_AT_LEAST(20111130, 0)
+		c->remote_ip = "192.0.2.1";
+#endif
+		c->bucket_alloc = apr_bucket_alloc_create(p);
+
+		module_accounting_post_config(p, p, p, s);
+		module_accounting_open_logs(p, p, p, s);
+		module_accounting_child_init(p, s);
+
+		/* Warm up, e.g. the per thread /proc file */
+		for (i = 0; i < 100; i++)
+			run_request(p, s, c, dir_config, shape);
+
+		memset(syscalls, 0, sizeof(syscalls));
+		miscounted = 0;
+		__real_clock_gettime(CLOCK_MONOTONIC, &begin);
+
+		for (i = 0; i < iterations; i++)
+			run_request(p, s, c, dir_config, shape);
+
+		__real_clock_gettime(CLOCK_MONOTONIC, &end);
+		memcpy(counted, syscalls, sizeof(counted));
+
+		printf(
+			"%-14s %-10s %8.0f ns/request",
+			backend->name,
+			shape_names[shape],
+			((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / iterations
+		);
+
+		for (j = 0; j < SYSCALLS; j++)
+			printf("  %s %.2f", syscall_names[j], (double) counted[j] / iterations);
+
+		printf("\n");
+
+		if (miscounted)
+			fprintf(stderr, "%s %s: bytes_out of %lu requests is off\n", backend->name, shape_names[shape], miscounted);
+
+		apr_pool_destroy(p);
+	}
+} // }}}
+
+
+int main(int argc, const char * const *argv){ // {{{
+	apr_pool_t *p;
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+	unsigned i;
+
+	if (iterations < 1)
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	apr_app_initialize(&argc, &argv, NULL);
+	apr_pool_create(&p, NULL);
+
+	accounting_module.module_index = 0;
+
+	printf("# %d requests per backend and shape, system calls per request\n", iterations);
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		run_backend(p, &(backends[i]), iterations);
+
+	apr_pool_destroy(p);
+	apr_terminate();
+
+	return 0;
+} // }}}
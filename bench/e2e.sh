@@ -0,0 +1,96 @@
+#!/bin/sh
+# End to end load test: the same static file and CGI script served by a
+# scratch httpd without and with mod_accounting, through ab or wrk.
+#
+#   bench/e2e.sh [requests] [concurrency]
+#
+# Needs apxs2 and a built mod_accounting.so. HTTPD, PORT, MPM and TOOL
+# (ab or wrk) can be set in the environment.
+set -e
+
+REQUESTS=${1:-20000}
+CONCURRENCY=${2:-16}
+PORT=${PORT:-18080}
+MPM=${MPM:-event}
+TOOL=${TOOL:-ab}
+
+HTTPD=${HTTPD:-$(apxs2 -q SBINDIR)/$(apxs2 -q TARGET)}
+MODULES=$(apxs2 -q LIBEXECDIR)
+MODULE=$(cd "$(dirname "$0")/.." && pwd)/.libs/mod_accounting.so
+
+if [ ! -f "$MODULE" ]; then
+	echo "Build mod_accounting.so first" >&2
+	exit 1
+fi
+
+ROOT=$(mktemp -d)
+trap 'kill $(cat "$ROOT/httpd.pid" 2>/dev/null) 2>/dev/null; rm -rf "$ROOT"' EXIT
+
+mkdir -p "$ROOT/htdocs" "$ROOT/cgi-bin" "$ROOT/logs"
+head -c 4096 /dev/zero > "$ROOT/htdocs/index.html"
+printf '#!/bin/sh\necho Content-Type: text/plain\necho\necho ok\n' > "$ROOT/cgi-bin/test.cgi"
+chmod +x "$ROOT/cgi-bin/test.cgi"
+
+# Write the configuration, $1 is any extra configuration
+configure() {
+	cat > "$ROOT/httpd.conf" <<CONF
+ServerRoot "$ROOT"
+Listen 127.0.0.1:$PORT
+PidFile "$ROOT/httpd.pid"
+ErrorLog "$ROOT/logs/error_log"
+DocumentRoot "$ROOT/htdocs"
+LoadModule mpm_${MPM}_module $MODULES/mod_mpm_${MPM}.so
+LoadModule authz_core_module $MODULES/mod_authz_core.so
+LoadModule mime_module $MODULES/mod_mime.so
+LoadModule alias_module $MODULES/mod_alias.so
+LoadModule cgid_module $MODULES/mod_cgid.so
+LoadModule unixd_module $MODULES/mod_unixd.so
+ScriptAlias /cgi-bin/ "$ROOT/cgi-bin/"
+$1
+CONF
+}
+
+# Print the requests per second for one URL
+load() {
+	case "$TOOL" in
+		wrk)
+			wrk -t 4 -c "$CONCURRENCY" -d 10s "http://127.0.0.1:$PORT$1" |
+				awk '/^Requests\/sec/ { print $2 }'
+			;;
+		*)
+			ab -q -k -n "$REQUESTS" -c "$CONCURRENCY" "http://127.0.0.1:$PORT$1" |
+				awk '/^Requests per second/ { print $4 }'
+			;;
+	esac
+}
+
+# Run every URL against one configuration, $1 names it
+run() {
+	"$HTTPD" -f "$ROOT/httpd.conf" -k start
+	sleep 1
+
+	for url in /index.html /cgi-bin/test.cgi; do
+		load "$url" > /dev/null	# warm up
+		printf '%-24s %-20s %s req/s\n' "$1" "$url" "$(load "$url")"
+	done
+
+	"$HTTPD" -f "$ROOT/httpd.conf" -k stop
+	sleep 1
+}
+
+configure ""
+run "without"
+
+configure "LoadModule accounting_module $MODULE"
+run "with"
+
+configure "LoadModule accounting_module $MODULE
+AccountingAggregate On
+AccountingHistograms On"
+run "with aggregate"
+
+configure "LoadModule accounting_module $MODULE
+AccountingPhases On
+AccountingBytes On
+AccountingThreadIO On"
+run "with phases,bytes,io"
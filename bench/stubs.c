@@ -0,0 +1,199 @@
+/* Just enough of httpd for bench_hooks
+ *
+ * Nothing is logged or written, output filters run in a chain of their
+ * own and only the hooks that bench_hooks calls directly will ever run.
+ */
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "http_request.h"
+#include "util_filter.h"
+#include "ap_mpm.h"
+#include "unixd.h"
+
+#include <string.h>
+
+/* Logging, at the level bench_hooks sets; nothing is written */ // {{{
+int stub_loglevel = APLOG_EMERG;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20100606, 0)
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index, int level, apr_status_t status, const server_rec *s, const char *fmt, ...){ }
+AP_DECLARE(void) ap_log_rerror_(const char *file, int line, int module_index, int level, apr_status_t status, const request_rec *r, const char *fmt, ...){ }
+
+AP_DECLARE(int) ap_get_server_module_loglevel(const server_rec *s, int index){
+	return stub_loglevel;
+}
+
+AP_DECLARE(int) ap_get_request_module_loglevel(const request_rec *r, int index){
+	return stub_loglevel;
+}
+#else
+AP_DECLARE(void) ap_log_error(const char *file, int line, int level, apr_status_t status, const server_rec *s, const char *fmt, ...){ }
+AP_DECLARE(void) ap_log_rerror(const char *file, int line, int level, apr_status_t status, const request_rec *r, const char *fmt, ...){ }
+#endif
+// }}}
+
+/* Configuration */ // {{{
+AP_DECLARE(const char *) ap_check_cmd_context(cmd_parms *cmd, unsigned forbidden){
+	return NULL;
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname){
+	return apr_pstrdup(p, fname);
+}
+
+/* Threaded, like the event and worker MPMs */
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int *result){
+	*result = query_code == AP_MPMQ_IS_THREADED ? AP_MPMQ_STATIC : 0;
+	return APR_SUCCESS;
+}
+
+AP_DECLARE(ap_unix_identity_t *) ap_run_get_suexec_identity(const request_rec *r){
+	return NULL;
+}
+
+#if AP_MODULE_MAGIC_AT_LEAST(20100606, 0)
+AP_DECLARE_DATA unixd_config_rec ap_unixd_config;
+#else
+AP_DECLARE_DATA unixd_config_rec unixd_config;
+#endif
+// }}}
+
+/* Piped logs */ // {{{
+AP_DECLARE(piped_log *) ap_open_piped_log(apr_pool_t *p, const char *program){
+	return NULL;
+}
+
+AP_DECLARE(apr_file_t *) ap_piped_log_write_fd(piped_log *pl){
+	return NULL;
+}
+// }}}
+
+/* Responses and filters */ // {{{
+AP_DECLARE(void) ap_set_content_type(request_rec *r, const char *ct){
+	r->content_type = ct;
+}
+
+#if AP_MODULE_MAGIC_AT_LEAST(20100606, 0)
+AP_DECLARE(int) ap_rwrite(const void *buf, int nbyte, request_rec *r){
+	return nbyte;
+}
+#else
+AP_DECLARE(int) ap_rputs(const char *str, request_rec *r){
+	return strlen(str);
+}
+#endif
+
+/* Output filters are kept in one chain per request, sorted by type like
+ * httpd does, with r->proto_output_filters pointing at its protocol part
+ * so an internal redirect can inherit that. Input filters aren't run. */
+#define STUB_FILTERS 8
+
+static ap_filter_rec_t filter_recs[STUB_FILTERS];
+static int filter_count = 0;
+
+static ap_filter_rec_t *register_filter(const char *name, ap_filter_type ftype){
+	ap_filter_rec_t *frec = &(filter_recs[filter_count < STUB_FILTERS - 1 ? filter_count++ : filter_count]);
+
+	frec->name = name;
+	frec->ftype = ftype;
+
+	return frec;
+}
+
+AP_DECLARE(ap_filter_rec_t *) ap_register_output_filter(const char *name, ap_out_filter_func filter_func, ap_init_filter_func filter_init, ap_filter_type ftype){
+	ap_filter_rec_t *frec = register_filter(name, ftype);
+
+	frec->filter_func.out_func = filter_func;
+
+	return frec;
+}
+
+AP_DECLARE(ap_filter_rec_t *) ap_register_input_filter(const char *name, ap_in_filter_func filter_func, ap_init_filter_func filter_init, ap_filter_type ftype){
+	ap_filter_rec_t *frec = register_filter(name, ftype);
+
+	frec->filter_func.in_func = filter_func;
+
+	return frec;
+}
+
+AP_DECLARE(ap_filter_t *) ap_add_output_filter_handle(ap_filter_rec_t *frec, void *ctx, request_rec *r, conn_rec *c){
+	ap_filter_t *f = apr_pcalloc(r->pool, sizeof(ap_filter_t));
+	ap_filter_t **next;
+
+	f->frec = frec;
+	f->ctx = ctx;
+	f->r = r;
+	f->c = c;
+
+	for (next = &(r->output_filters); *next && (*next)->frec->ftype <= frec->ftype; next = &((*next)->next))
+		;
+
+	f->next = *next;
+	*next = f;
+
+	/* The first protocol filter starts the protocol part */
+	if (frec->ftype >= AP_FTYPE_PROTOCOL && f->next == r->proto_output_filters)
+		r->proto_output_filters = f;
+
+	return f;
+}
+
+AP_DECLARE(ap_filter_t *) ap_add_input_filter_handle(ap_filter_rec_t *f, void *ctx, request_rec *r, conn_rec *c){
+	return NULL;
+}
+
+AP_DECLARE(void) ap_remove_output_filter(ap_filter_t *f){
+	ap_filter_t **next;
+
+	for (next = &(f->r->output_filters); *next; next = &((*next)->next))
+	{
+		if (*next == f)
+		{
+			*next = f->next;
+			break;
+		}
+	}
+
+	if (f->r->proto_output_filters == f)
+		f->r->proto_output_filters = f->next;
+}
+
+/* The end of the chain drops everything */
+AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *filter, apr_bucket_brigade *bucket){
+	if (filter)
+		return filter->frec->filter_func.out_func(filter, bucket);
+
+	apr_brigade_cleanup(bucket);
+	return APR_SUCCESS;
+}
+
+AP_DECLARE(apr_status_t) ap_get_brigade(ap_filter_t *filter, apr_bucket_brigade *bucket, ap_input_mode_t mode, apr_read_type_e block, apr_off_t readbytes){
+	return APR_EOF;
+}
+
+AP_DECLARE_NONSTD(apr_status_t) ap_filter_flush(apr_bucket_brigade *bb, void *ctx){
+	apr_brigade_cleanup(bb);
+	return APR_SUCCESS;
+}
+// }}}
+
+/* Hook registration, nothing is run through them */ // {{{
+#define STUB_HOOK(name) \
+	AP_DECLARE(void) ap_hook_##name(ap_HOOK_##name##_t *pf, const char * const *pre, const char * const *succ, int order){ }
+
+STUB_HOOK(post_read_request)
+STUB_HOOK(create_request)
+STUB_HOOK(log_transaction)
+STUB_HOOK(pre_config)
+STUB_HOOK(post_config)
+STUB_HOOK(open_logs)
+STUB_HOOK(child_init)
+STUB_HOOK(translate_name)
+STUB_HOOK(map_to_storage)
+STUB_HOOK(access_checker)
+STUB_HOOK(fixups)
+STUB_HOOK(insert_filter)
+STUB_HOOK(handler)
+// }}}
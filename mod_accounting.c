@@ -1,39 +1,936 @@
 #include "httpd.h"
 #include "http_log.h"
 #include "http_config.h"
+#include "ap_mpm.h"
+#include "http_protocol.h"
+#include "http_core.h"
+#include "http_request.h"
+#include "util_filter.h"
+#include "mod_log_config.h"
+#include "mod_proxy.h"
+#include "unixd.h"
+#include "mod_accounting.h"
 
 #include <time.h>
 #include <unistd.h>
 #include <sys/times.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 #include <apr_strings.h>
+#include <apr_lib.h>
+#include <apr_optional.h>
+#include <apr_shm.h>
+#include <apr_mmap.h>
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <apr_portable.h>
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include "acc_binlog.h"
+#include <string.h>
+#include <strings.h>
 
 /* Forward module declaration (why?) */
 module AP_MODULE_DECLARE_DATA accounting_module;
 
-/* Struct that contains the (begin) reference values */
+#ifdef APLOG_USE_MODULE
+APLOG_USE_MODULE(accounting);
+#endif
+
+/* Sources for the CPU time of a request
+ *
+ * With the prefork MPM the usage of the process is the usage of the request,
+ * but worker and event serve several requests in one process at the same
+ * time. There the usage has to be taken from the calling thread instead.
+ */
+enum {
+	ACC_CPU_UNSET = -1,
+	ACC_CPU_AUTO,		/* thread when the MPM is threaded, else process */
+	ACC_CPU_PROCESS,	/* getrusage(RUSAGE_SELF) */
+	ACC_CPU_THREAD		/* getrusage(RUSAGE_THREAD) or the thread CPU clock */
+};
+
+/* Clocks for the (wall clock) time of a request
+ *
+ * The time of day can jump backwards when the clock is stepped, and it
+ * duplicates what %D already logs. The monotonic clocks can't, and the
+ * coarse one is cheaper again at the cost of a resolution of one tick.
+ * With "request" the begin time is the time the request was read, which
+ * saves a clock read and gives the same time as %D.
+ */
+enum {
+	ACC_CLOCK_UNSET = -1,
+	ACC_CLOCK_REALTIME,
+	ACC_CLOCK_MONOTONIC,
+	ACC_CLOCK_COARSE,
+	ACC_CLOCK_REQUEST
+};
+
+/* When to reap terminated children before measuring their usage
+ *
+ * RUSAGE_CHILDREN only includes children that have been waited for, but
+ * e.g. mod_cgi only waits for its CGI process when the request pool is
+ * destroyed, after logging. Reaping every child on every request however
+ * costs a syscall and steals children from other modules.
+ *
+ * Only children that a module registered with acc_note_child() are waited
+ * for by PID. Neither mod_cgi nor mod_cgid do, so after their handlers
+ * (the default AccountingReapHandler) any terminated child is reaped.
+ */
+enum {
+	ACC_REAP_UNSET = -1,
+	ACC_REAP_OFF,		/* only children registered with acc_note_child() */
+	ACC_REAP_HANDLER,	/* also after a handler that spawns children ran */
+	ACC_REAP_ALWAYS		/* also on every request */
+};
+
+/* URI prefix with its own aggregated counters */
 typedef struct {
-	struct timeval begin_time;
-	struct rusage  begin_own_usage;
-	struct rusage  begin_child_usage;
-	
-	/* Because we put this struct directly in the r->notes (***DIRTY***)
-	 * we explicitly make sure it's zero terminated (although it's very
-	 * likely the message already contains some zero bytes. */
-	char           zero;
+	const char *prefix;
+	apr_size_t  len;
+	int         slot;
+} acc_prefix;
+
+/* Per server configuration */
+typedef struct {
+	int cpu_source;
+	int clock;
+	int anomaly_interval;
+	int trace;
+	int notes;
+	int reap;
+	apr_array_header_t *reap_handlers;
+	int conn_snapshot;
+	int lean;
+	int sample_rate;
+	apr_int64_t slow_threshold;	/* microseconds */
+	int phases;
+	int bytes;
+	int thread_io;
+	int memory;
+	int subrequests;	/* entries per request, or 0 */
+	int backend;
+	const char *backend_header;
+	int aggregate;
+	int histograms;
+	apr_int64_t budget;		/* CPU microseconds per window, or 0 */
+	apr_time_t  budget_window;
+	int         budget_action;
+	apr_time_t  budget_delay;
+	apr_array_header_t *prefixes;
+	int         key_source;	/* see ACC_KEY_* */
+	const char *key_name;	/* of the variable or header */
+
+	/* Delegated cgroup v2 directory, only set for the main server */
+	const char *cgroup_root;
+
+	/* Heavy hitter entries per table, only set for the main server */
+	int hitters;
+
+	/* Capacity of the key table, only set for the main server */
+	int keys;
+
+	/* File that keeps the segment across restarts, only set for the
+	 * main server */
+	const char *state_file;
+
+	/* Collector, only set for the main server */
+	const char *export_host;
+	apr_port_t  export_port;
+	apr_time_t  export_interval;
+	apr_size_t  export_packet;
+
+	/* Binary log, only set for the main server */
+	const char *binlog_path;
+	apr_size_t  binlog_buffer;
+	apr_time_t  binlog_interval;
+
+	/* "hostname:port" of the server, and a hash of it that identifies
+	 * the server in the binary log */
+	const char  *name;
+	apr_uint32_t id;
+
+	/* Index of the counters of this server in the shared memory */
+	int slot;
+} acc_server_conf;
+
+/* Per directory configuration
+ *
+ * module_accounting_start() runs before the location of a request is
+ * known, so it can only see the configuration of the server, outside of
+ * any <Location> or <Directory>. There "Accounting Off" skips a request
+ * entirely. Inside a section it's checked again when the request ends,
+ * and the request is then measured but not reported anywhere.
+ */
+typedef struct {
+	int                  enabled;
+	const unsigned char *selected;	/* AccountingMetrics, or NULL for all */
+} acc_dir_conf;
+
+/* Phases of a request
+ *
+ * With "AccountingPhases On" the time of a request is split up at the
+ * start of these phases. A phase lasts until the next one starts, so the
+ * handler phase ends when the first output reaches the filters, and the
+ * output phase is everything from then on. Phases that run again after an
+ * internal redirect are added up.
+ */
+enum {
+	ACC_PHASE_READ,		/* post_read_request */
+	ACC_PHASE_TRANSLATE,	/* translate_name, e.g. mod_rewrite */
+	ACC_PHASE_MAP,		/* map_to_storage (directory walk and .htaccess)
+				 * and header_parser */
+	ACC_PHASE_AUTH,		/* access, authn, authz and type checking */
+	ACC_PHASE_FIXUPS,	/* fixups */
+	ACC_PHASE_HANDLER,	/* the handler, until its first output */
+	ACC_PHASE_OUTPUT,	/* the rest of the handler and the output filters */
+	ACC_PHASES
+};
+
+/* The values that are measured for each request
+ *
+ * Every metric has a name, which is used by the %{name}Z log format item,
+ * and a key for the request_rec->notes table. Metrics belong to a group,
+ * which is only measured (and reported) when it's enabled.
+ */
+enum {
+	ACC_GROUP_TIME     = 1 << 0,	/* also for requests that aren't sampled */
+	ACC_GROUP_PHASES   = 1 << 1,	/* AccountingPhases */
+	ACC_GROUP_BACKEND  = 1 << 2,	/* AccountingBackend, proxied requests */
+	ACC_GROUP_CGROUP   = 1 << 3,	/* AccountingCgroup */
+	ACC_GROUP_MEMORY   = 1 << 4,	/* AccountingMemory */
+	ACC_GROUP_BASE     = 1 << 5,	/* the CPU time */
+	ACC_GROUP_BYTES    = 1 << 6,	/* AccountingBytes */
+	ACC_GROUP_IO       = 1 << 7,	/* AccountingThreadIO */
+	ACC_GROUP_RUSAGE   = 1 << 8,	/* the rest of getrusage(), not with AccountingLean */
+	ACC_GROUP_CHILDREN = 1 << 9,	/* of reaped children, with AccountingLean only when expected */
+};
+
+/* Fields of /proc/thread-self/io, see io_keys */
+#define ACC_IO_KEYS 6
+
+enum {
+	ACC_M_TIME,
+	ACC_M_UTIME,
+	ACC_M_STIME,
+	ACC_M_CUTIME,
+	ACC_M_CSTIME,
+	ACC_M_INBLOCK,
+	ACC_M_OUBLOCK,
+	ACC_M_CINBLOCK,
+	ACC_M_COUBLOCK,
+	ACC_M_MINFLT,
+	ACC_M_MAJFLT,
+	ACC_M_MAXRSS_DELTA,
+	ACC_M_NVCSW,
+	ACC_M_NIVCSW,
+	ACC_M_CMINFLT,
+	ACC_M_CMAJFLT,
+	ACC_M_CNVCSW,
+	ACC_M_CNIVCSW,
+
+	/* Time and thread CPU time per phase, in the order of ACC_PHASE_* */
+	ACC_M_PHASES,
+	ACC_M_PHASES_END = ACC_M_PHASES + 2 * ACC_PHASES,
+
+	/* Proxied requests */
+	ACC_M_BACKEND_TIME = ACC_M_PHASES_END,
+	ACC_M_BACKEND_TTFB,
+	ACC_M_BACKEND_UTIME,
+	ACC_M_BACKEND_STIME,
+
+	/* From the cgroup of the worker */
+	ACC_M_CGROUP_CUTIME,
+	ACC_M_CGROUP_CSTIME,
+	ACC_M_CGROUP_READ_BYTES,
+	ACC_M_CGROUP_WRITE_BYTES,
+	ACC_M_CGROUP_MEMORY_PEAK,
+
+	/* Memory allocated for the request */
+	ACC_M_POOL_BYTES,
+
+	/* Network traffic */
+	ACC_M_BYTES_IN,
+	ACC_M_BYTES_OUT,
+	ACC_M_TTFB,
+
+	/* I/O of the thread, in the order of io_keys */
+	ACC_M_IO,
+	ACC_M_IO_END = ACC_M_IO + ACC_IO_KEYS,
+
+	ACC_METRICS = ACC_M_IO_END
+};
+
+typedef struct {
+	const char *name;
+	const char *notes_key;
+	const char *unit;
+	int         group;
+} acc_metric;
+
+static const acc_metric metrics[ACC_METRICS] = {
+	{ "time",     "ACC_time",     "microseconds", ACC_GROUP_TIME },
+	{ "utime",    "ACC_utime",    "microseconds", ACC_GROUP_BASE },
+	{ "stime",    "ACC_stime",    "microseconds", ACC_GROUP_BASE },
+	{ "cutime",   "ACC_cutime",   "microseconds", ACC_GROUP_CHILDREN },
+	{ "cstime",   "ACC_cstime",   "microseconds", ACC_GROUP_CHILDREN },
+	{ "inblock",  "ACC_inblock",  "blocks",       ACC_GROUP_RUSAGE },
+	{ "oublock",  "ACC_oublock",  "blocks",       ACC_GROUP_RUSAGE },
+	{ "cinblock", "ACC_cinblock", "blocks",       ACC_GROUP_CHILDREN },
+	{ "coublock", "ACC_coublock", "blocks",       ACC_GROUP_CHILDREN },
+	{ "minflt",   "ACC_minflt",   "faults",       ACC_GROUP_RUSAGE },
+	{ "majflt",   "ACC_majflt",   "faults",       ACC_GROUP_RUSAGE },
+	{ "maxrss_delta", "ACC_maxrss_delta", "kilobytes", ACC_GROUP_RUSAGE },
+	{ "nvcsw",    "ACC_nvcsw",    "switches",     ACC_GROUP_RUSAGE },
+	{ "nivcsw",   "ACC_nivcsw",   "switches",     ACC_GROUP_RUSAGE },
+	{ "cminflt",  "ACC_cminflt",  "faults",       ACC_GROUP_CHILDREN },
+	{ "cmajflt",  "ACC_cmajflt",  "faults",       ACC_GROUP_CHILDREN },
+	{ "cnvcsw",   "ACC_cnvcsw",   "switches",     ACC_GROUP_CHILDREN },
+	{ "cnivcsw",  "ACC_cnivcsw",  "switches",     ACC_GROUP_CHILDREN },
+
+	{ "phase_read_time",      "ACC_phase_read_time",      "microseconds", ACC_GROUP_PHASES },
+	{ "phase_read_cpu",       "ACC_phase_read_cpu",       "microseconds", ACC_GROUP_PHASES },
+	{ "phase_translate_time", "ACC_phase_translate_time", "microseconds", ACC_GROUP_PHASES },
+	{ "phase_translate_cpu",  "ACC_phase_translate_cpu",  "microseconds", ACC_GROUP_PHASES },
+	{ "phase_map_time",       "ACC_phase_map_time",       "microseconds", ACC_GROUP_PHASES },
+	{ "phase_map_cpu",        "ACC_phase_map_cpu",        "microseconds", ACC_GROUP_PHASES },
+	{ "phase_auth_time",      "ACC_phase_auth_time",      "microseconds", ACC_GROUP_PHASES },
+	{ "phase_auth_cpu",       "ACC_phase_auth_cpu",       "microseconds", ACC_GROUP_PHASES },
+	{ "phase_fixups_time",    "ACC_phase_fixups_time",    "microseconds", ACC_GROUP_PHASES },
+	{ "phase_fixups_cpu",     "ACC_phase_fixups_cpu",     "microseconds", ACC_GROUP_PHASES },
+	{ "phase_handler_time",   "ACC_phase_handler_time",   "microseconds", ACC_GROUP_PHASES },
+	{ "phase_handler_cpu",    "ACC_phase_handler_cpu",    "microseconds", ACC_GROUP_PHASES },
+	{ "phase_output_time",    "ACC_phase_output_time",    "microseconds", ACC_GROUP_PHASES },
+	{ "phase_output_cpu",     "ACC_phase_output_cpu",     "microseconds", ACC_GROUP_PHASES },
+
+	{ "backend_time",  "ACC_backend_time",  "microseconds", ACC_GROUP_BACKEND },
+	{ "backend_ttfb",  "ACC_backend_ttfb",  "microseconds", ACC_GROUP_BACKEND },
+	{ "backend_utime", "ACC_backend_utime", "microseconds", ACC_GROUP_BACKEND },
+	{ "backend_stime", "ACC_backend_stime", "microseconds", ACC_GROUP_BACKEND },
+
+	{ "cgroup_cutime",      "ACC_cgroup_cutime",      "microseconds", ACC_GROUP_CGROUP },
+	{ "cgroup_cstime",      "ACC_cgroup_cstime",      "microseconds", ACC_GROUP_CGROUP },
+	{ "cgroup_read_bytes",  "ACC_cgroup_read_bytes",  "bytes",        ACC_GROUP_CGROUP },
+	{ "cgroup_write_bytes", "ACC_cgroup_write_bytes", "bytes",        ACC_GROUP_CGROUP },
+	{ "cgroup_memory_peak", "ACC_cgroup_memory_peak", "bytes",        ACC_GROUP_CGROUP },
+
+	{ "pool_bytes", "ACC_pool_bytes", "bytes", ACC_GROUP_MEMORY },
+
+	{ "bytes_in",  "ACC_bytes_in",  "bytes",        ACC_GROUP_BYTES },
+	{ "bytes_out", "ACC_bytes_out", "bytes",        ACC_GROUP_BYTES },
+	{ "ttfb",      "ACC_ttfb",      "microseconds", ACC_GROUP_BYTES },
+
+	{ "io_rchar",       "ACC_io_rchar",       "bytes",   ACC_GROUP_IO },
+	{ "io_wchar",       "ACC_io_wchar",       "bytes",   ACC_GROUP_IO },
+	{ "io_syscr",       "ACC_io_syscr",       "calls",   ACC_GROUP_IO },
+	{ "io_syscw",       "ACC_io_syscw",       "calls",   ACC_GROUP_IO },
+	{ "io_read_bytes",  "ACC_io_read_bytes",  "bytes",   ACC_GROUP_IO },
+	{ "io_write_bytes", "ACC_io_write_bytes", "bytes",   ACC_GROUP_IO }
+};
+
+/* Groups that are enabled for any server, for the status handler */
+static int groups_enabled = ACC_GROUP_TIME | ACC_GROUP_BASE | ACC_GROUP_CHILDREN;
+
+/* Struct that contains the measured values of a request, in the units of
+ * the metric table. Values of groups that weren't measured are zero. */
+typedef struct {
+	int                  groups;
+	const unsigned char *selected;	/* of the location, see acc_dir_conf */
+	apr_int64_t          value[ACC_METRICS];
+} acc_result;
+
+#define MEASURED(res, m) ((res)->groups & metrics[m].group)
+
+/* Metrics for the notes, %{...}Z and acc_get_value(); the aggregated
+ * counters and the binary log always get every measured metric */
+#define REPORTED(res, m) (MEASURED(res, m) && (!(res)->selected || (res)->selected[m]))
+
+/* Time spent on backends of proxied requests
+ *
+ * The time runs from mod_proxy's pre_request hook, before a worker is
+ * chosen and connected, to its post_request hook. The time to first byte
+ * ends when the first response data reaches the output filters. The CPU
+ * time of the backend itself can only be known when the backend reports
+ * it, in the AccountingBackendHeader response header. A request can be
+ * proxied more than once through subrequests; the times are added up.
+ */
+typedef struct {
+	int            active;
+	int            first;	/* the first byte has been seen */
+	struct timeval start;
+	apr_int64_t    time;
+	apr_int64_t    ttfb;
+	apr_int64_t    utime;
+	apr_int64_t    stime;
+} acc_backend;
+
+/* Usage of a cgroup, from its cpu.stat and io.stat */
+typedef struct {
+	apr_int64_t user;	/* microseconds */
+	apr_int64_t system;
+	apr_int64_t rbytes;	/* summed over all devices */
+	apr_int64_t wbytes;
+} acc_cgroup_usage;
+
+/* I/O of a thread, from /proc/thread-self/io */
+typedef struct {
+	apr_int64_t value[ACC_IO_KEYS];
+} acc_io;
+
+/* The calling thread
+ *
+ * With the event MPM, log_transaction can run from write completion on
+ * another worker thread than the one that read the request. Values of
+ * the thread CPU source or clock taken on different threads can't be
+ * subtracted, so they're only used when both ends ran on the same one.
+ */
+#if APR_HAS_THREADS
+typedef apr_os_thread_t acc_thread;
+#define thread_self() apr_os_thread_current()
+#define thread_same(a, b) apr_os_thread_equal((a), (b))
+#else
+typedef int acc_thread;
+#define thread_self() 0
+#define thread_same(a, b) 1
+#endif
+
+/* Progress through the phases of a request */
+typedef struct {
+	int            current;
+	acc_thread     thread;	/* that took cpu */
+	struct timeval wall;	/* start of the current phase */
+	apr_int64_t    cpu;
+	apr_int64_t    time[ACC_PHASES];
+	apr_int64_t    cpu_time[ACC_PHASES];
+} acc_phases;
+
+/* The fields of a struct rusage that are used, see usage_keep() */
+typedef struct {
+	struct timeval utime;
+	struct timeval stime;
+	long           inblock;
+	long           oublock;
+	long           minflt;
+	long           majflt;
+	long           maxrss;
+	long           nvcsw;
+	long           nivcsw;
+} acc_usage;
+
+/* A subrequest of a request, with AccountingSubrequests
+ *
+ * It's timed from its creation until its pool is destroyed, so a lookup
+ * that is never run counts as well. Only subrequests of the main request
+ * itself are kept; nested ones count for the subrequest they're in.
+ */
+typedef struct {
+	const char  *uri;	/* escaped, so it has no spaces */
+	int          status;
+	apr_int64_t  time;	/* microseconds */
+	apr_int64_t  cpu;	/* of the thread */
+} acc_subrequest;
+
+/* The state of a request that's only there when it's configured
+ *
+ * It's allocated apart from acc_data when any of it is configured for
+ * the server, see data_optional(); otherwise acc_data points at an empty
+ * one, that is only ever read.
+ */
+typedef struct {
+	/* Only with AccountingPhases */
+	acc_phases         *phases;
+
+	/* Only for proxied requests with AccountingBackend */
+	acc_backend        *backend;
+
+	/* Only with AccountingBytes, see bytes_out_filter() */
+	apr_int64_t         bytes_in;
+	apr_int64_t         bytes_out;
+	apr_int64_t         ttfb;	/* -1 until the first byte */
+
+	/* Only with AccountingMemory, see heap_in_use() */
+	apr_int64_t         begin_heap;
+
+	/* Only with AccountingThreadIO, when it could be read */
+	acc_io             *begin_io;
+
+	/* Only with AccountingCgroup, when it could be read */
+	acc_cgroup_usage   *begin_cgroup;
+
+	/* Only with AccountingSubrequests, the summary is set at the end */
+	apr_array_header_t *subrequests;
+	int                 subrequests_dropped;
+	const char         *subrequests_summary;
+} acc_optional;
+
+static acc_optional no_optional;
+
+/* Struct that contains the (begin) reference values
+ *
+ * It's stored in the request_config of the first request of the internal
+ * redirect chain, where module_accounting_stop() also leaves the results.
+ * What every request needs comes first; everything that's only measured
+ * when it's configured, or only for some requests, is allocated apart,
+ * which keeps it at 168 bytes on LP64.
+ */
+typedef struct {
+	/* Scale of a sampled request, or zero when it's not sampled and none
+	 * of the values below are known */
+	int            weight;
+
+	/* The request it's stored with, and its number on the connection
+	 * with AccountingConnectionSnapshot, see acc_conn */
+	apr_uint32_t   seq;
+	request_rec   *initial;
+
+	/* Id of the AccountingKey of the request, or 0 while it's not known */
+	apr_uint32_t   key;
+
+	/* To reap any child at the end, see ACC_REAP_* */
+	int            reap_any;
+
+	/* That took the begin values, see acc_thread */
+	acc_thread     thread;
+
+	struct timeval begin_time;	/* of the configured AccountingClock */
+	acc_usage      begin_own;
+
+	/* Usage of the children, or NULL when they're not measured, see
+	 * child_usage_begin() */
+	acc_usage          *begin_child;
+
+	/* Children to reap, see acc_note_child() */
+	apr_array_header_t *children;
+
+	/* What's only measured when it's configured, see acc_optional */
+	acc_optional       *optional;
+
+	/* Allocated by module_accounting_stop(), NULL until it's done */
+	acc_result         *result;
 } acc_data;
 
-/* Key values for use in the request_rec->notes table */
-static const char *notes_key_internal = "ACC_INTERNAL";
-static const char     *notes_key_time = "ACC_time";
-static const char    *notes_key_utime = "ACC_utime";
-static const char    *notes_key_stime = "ACC_stime";
-static const char   *notes_key_cutime = "ACC_cutime";
-static const char   *notes_key_cstime = "ACC_cstime";
-static const char  *notes_key_inblock = "ACC_inblock";
-static const char  *notes_key_oublock = "ACC_oublock";
-static const char *notes_key_cinblock = "ACC_cinblock";
-static const char *notes_key_coublock = "ACC_coublock";
+/* Usage at the end of the last request on a connection
+ *
+ * With "AccountingConnectionSnapshot On" it's kept in the conn_config,
+ * and the next request on the keep-alive connection takes it as its
+ * begin values instead of calling getrusage() again. That's only right
+ * when nothing ran in between that it would miss, so it's only reused
+ * when no other request on the connection started in the meantime, which
+ * happens with pipelining, and with the thread CPU source only by the
+ * same thread.
+ */
+typedef struct {
+	apr_uint32_t    seq;	/* requests started on the connection */
+	int             valid;
+	int             cpu_source;
+	int             lean;
+#if APR_HAS_THREADS
+	apr_os_thread_t thread;
+#endif
+	acc_usage       own_usage;
+	int             child;	/* child_usage is valid */
+	acc_usage       child_usage;
+} acc_conn;
+
+/* Aggregated usage in shared memory
+ *
+ * With "AccountingAggregate On" every request adds its results to the
+ * counters of its server in a shared memory segment, which is created in
+ * post_config and inherited by the children. The counters are only ever
+ * updated with atomic adds, so the children don't serialize on a lock.
+ * Every slot is padded to a multiple of the cache line size, so servers
+ * that are busy at the same time don't share cache lines either.
+ */
+#define ACC_CACHE_LINE 64
+#define ACC_PAD(size) ((((size) + ACC_CACHE_LINE - 1) / ACC_CACHE_LINE) * ACC_CACHE_LINE)
+
+/* Histograms of the time and CPU time of requests
+ *
+ * With "AccountingHistograms On" requests are also counted in log-linear
+ * buckets, like HdrHistogram: values below 2^ACC_BUCKET_BITS have a
+ * bucket each, and every power of two above that is split into as many
+ * buckets again, so a bucket is never more than 12.5% wide. Values from
+ * 2^ACC_BUCKET_MAX_EXP microseconds (12 days) on share the last bucket.
+ */
+#define ACC_BUCKET_BITS    3
+#define ACC_BUCKET_SUB     (1 << ACC_BUCKET_BITS)
+#define ACC_BUCKET_MAX_EXP 40
+#define ACC_BUCKETS        (ACC_BUCKET_SUB * (ACC_BUCKET_MAX_EXP - ACC_BUCKET_BITS + 2))
+
+enum {
+	ACC_HIST_TIME,		/* time */
+	ACC_HIST_CPU,		/* utime + stime */
+	ACC_HIST_CHILD_CPU,	/* cutime + cstime */
+	ACC_HISTOGRAMS
+};
+
+static const char *histogram_names[ACC_HISTOGRAMS] = {
+	"time",
+	"cpu",
+	"child_cpu"
+};
+
+/* The percentiles that are reported, in thousandths */
+static const int percentiles[] = { 500, 900, 990, 999 };
+#define ACC_PERCENTILES ((int) (sizeof(percentiles) / sizeof(percentiles[0])))
+
+/* CPU budgets
+ *
+ * With AccountingCpuBudget the CPU time (including children) of the
+ * requests of a server is also kept in a ring of ACC_BUDGET_BUCKETS
+ * buckets that each cover a tenth of the window, counted in ticks since
+ * the segment was created. A bucket that comes around again is claimed
+ * with a compare-and-swap of its tick and then cleared; requests that end
+ * right at that moment may be lost from it. Checking the budget is just
+ * reading the buckets, without any lock.
+ */
+#define ACC_BUDGET_BUCKETS 10
+
+/* Only defined as of httpd 2.4 */
+#ifndef HTTP_TOO_MANY_REQUESTS
+#define HTTP_TOO_MANY_REQUESTS 429
+#endif
+
+enum {
+	ACC_BUDGET_UNSET = -1,
+	ACC_BUDGET_REJECT,	/* with a 503 */
+	ACC_BUDGET_LIMIT,	/* with a 429 */
+	ACC_BUDGET_DELAY	/* sleep, then serve the request anyway */
+};
+
+typedef struct {
+	volatile apr_uint32_t tick;
+	apr_uint64_t          cpu;	/* microseconds */
+} acc_budget_bucket;
+
+typedef struct {
+	apr_uint64_t requests;
+	apr_uint64_t value[ACC_METRICS];
+	apr_uint64_t histogram[ACC_HISTOGRAMS][ACC_BUCKETS];
+	acc_budget_bucket budget[ACC_BUDGET_BUCKETS];
+} acc_counters;
+
+typedef union {
+	acc_counters counters;
+	char         pad[ACC_PAD(sizeof(acc_counters))];
+} acc_slot;
+
+/* Anomalies in the measured values, which are counted and reported with
+ * at most one error log message per interval instead of one per request */
+enum {
+	ACC_ANOMALY_TIME,	/* end time before the begin time */
+	ACC_ANOMALY_BLOCKS,	/* block count decreased */
+	ACC_ANOMALY_THREAD,	/* ended on another thread, see acc_thread */
+	ACC_ANOMALIES
+};
+
+static const char *anomaly_names[ACC_ANOMALIES] = {
+	"timetravel",
+	"negative_blocks",
+	"thread_switch"
+};
+
+#define ACC_ANOMALY_DEFAULT_INTERVAL 60
+
+/* Totals of the children that exited, see acc_lifetime */
+enum {
+	ACC_LIFETIME_EXITED,
+	ACC_LIFETIME_CPU,		/* of the processes, microseconds */
+	ACC_LIFETIME_REQUEST_CPU,	/* summed over their requests */
+	ACC_LIFETIME_CHILDREN_CPU,	/* of their reaped children */
+	ACC_LIFETIME_REQUEST_CHILDREN_CPU,
+	ACC_LIFETIMES
+};
+
+static const char *lifetime_names[ACC_LIFETIMES] = {
+	"exited",
+	"cpu",
+	"request_cpu",
+	"children_cpu",
+	"request_children_cpu"
+};
+
+/* Persistent counters
+ *
+ * With AccountingStateFile the segment is a file that's mapped shared
+ * instead, and that's attached again by the next generation when its
+ * header still matches: the same version of the layout, the same size,
+ * the same servers and prefixes in the same order, and as many heavy
+ * hitters and keys. Everything in it then simply carries on, including
+ * the budget windows, which count from when the file was created. A
+ * file that doesn't match is started over. Nothing is read or cleared
+ * entry by entry, so attaching doesn't take longer with more keys; only
+ * the heavy hitter locks are released, of children that were killed
+ * while holding one.
+ *
+ * ACC_STATE_VERSION has to change with any change to the layout of the
+ * segment that the size alone wouldn't tell.
+ */
+#define ACC_STATE_MAGIC   0x41434353	/* "ACCS" */
+#define ACC_STATE_VERSION 1
+
+typedef struct {
+	apr_uint32_t magic;
+	apr_uint32_t version;
+	apr_uint64_t size;		/* of the whole segment */
+	apr_uint64_t layout;		/* hash of the servers and prefixes */
+	apr_uint32_t slots;
+	apr_uint32_t hitter_sets;	/* per table, see acc_hitter_set */
+	apr_uint32_t exported;		/* there are acc_totals for AccountingExport */
+	volatile apr_uint32_t export_tick;
+	apr_time_t   created;
+	apr_uint64_t anomalies[ACC_ANOMALIES];
+	apr_uint64_t lifetimes[ACC_LIFETIMES];
+	apr_uint32_t keys;		/* capacity of the key table, see acc_key */
+	apr_uint64_t keys_dropped;	/* requests whose key didn't fit */
+} acc_shm_info;
+
+typedef union {
+	acc_shm_info h;
+	char         pad[ACC_PAD(sizeof(acc_shm_info))];
+} acc_shm_header;
+
+/* The segment, and its slots right after the header */
+static acc_shm_header *shm_header = NULL;
+#define SHM_SLOTS() ((acc_slot*) (shm_header + 1))
+
+/* Heavy hitters
+ *
+ * With AccountingHeavyHitters the segment also holds two Space-Saving
+ * sketches of the CPU time (user and system, including children) of
+ * requests: one by server and URI, one by client address. Each is a fixed
+ * table of small sets. A key only competes with the keys that hash into
+ * the same set: it takes over the entry with the least CPU time when it
+ * isn't there yet, which then also becomes its error margin. That keeps
+ * updates at ACC_HITTER_WAYS compares however many distinct keys come by.
+ *
+ * A set is locked with a spin lock, but a request never waits for long
+ * and drops its update instead, so a child that dies while holding one
+ * can't hold up the others. The status page doesn't take the lock, so it
+ * never makes a request drop its update; it copies a set again when its
+ * sequence changed, see hitter_copy(). The counts are since the segment
+ * was created.
+ */
+#define ACC_HITTER_WAYS   8
+#define ACC_HITTER_KEY    88
+#define ACC_HITTER_SPIN   64
+#define ACC_HITTER_COPIES 4
+#define ACC_HITTER_REPORT 25
+
+enum {
+	ACC_HITTER_URI,
+	ACC_HITTER_CLIENT,
+	ACC_HITTERS
+};
+
+static const char *hitter_names[ACC_HITTERS] = {
+	"uri",
+	"client"
+};
+
+typedef struct {
+	apr_uint64_t hash;
+	apr_uint64_t cpu;	/* microseconds, overestimated by at most error */
+	apr_uint64_t error;
+	apr_uint64_t requests;
+	apr_uint32_t server;	/* id of the server, for URIs */
+	apr_uint32_t key_id;	/* of the AccountingKey, for URIs, or 0 */
+	char         key[ACC_HITTER_KEY];
+} acc_hitter;
+
+typedef struct {
+	union {
+		struct {
+			volatile apr_uint32_t lock;
+			volatile apr_uint32_t seq;	/* odd while it's changed */
+		} w;
+		char pad[ACC_CACHE_LINE];
+	} l;
+	acc_hitter entries[ACC_HITTER_WAYS];
+} acc_hitter_set;
+
+/* The sets of a table, after the slots */
+#define SHM_HITTERS(table) \
+	((acc_hitter_set*) (SHM_SLOTS() + shm_header->h.slots) + (table) * shm_header->h.hitter_sets)
+
+/* Accounting keys
+ *
+ * With AccountingKey the requests of a server are also counted for a key
+ * taken from the request: the name of the virtual host, an environment
+ * variable, a request header or the suexec user. That way the vhosts of
+ * one customer add up, and the tenants of one vhost are told apart. The
+ * key is looked up once per request, as soon as it's known, and interned
+ * in a table in the segment: the URI heavy hitters are then kept by its
+ * id instead of by server, and with AccountingAggregate it has counters
+ * (and histograms) of its own, after the table.
+ *
+ * The table has room for AccountingKeys keys, uses open addressing with
+ * linear probing and never drops a key again until the next restart. An
+ * entry is claimed with a compare-and-swap and only matched once its key
+ * is written; one that's still being written after a short spin is
+ * passed over, so a key that two children add at the same time may
+ * rarely get a second entry. A key that isn't found within ACC_KEY_PROBES
+ * entries is counted as dropped for that request.
+ */
+#define ACC_KEY_SIZE     112
+#define ACC_KEY_PROBES   32
+#define ACC_KEYS_DEFAULT 256
+
+enum {
+	ACC_KEY_UNSET = -1,
+	ACC_KEY_NONE,
+	ACC_KEY_VHOST,		/* ServerName */
+	ACC_KEY_ENV,		/* subprocess_env, after the fixups */
+	ACC_KEY_HEADER,		/* request header */
+	ACC_KEY_USER		/* suexec uid, after the fixups */
+};
+
+enum {
+	ACC_KEY_FREE,
+	ACC_KEY_CLAIMED,
+	ACC_KEY_READY
+};
+
+typedef struct {
+	volatile apr_uint32_t state;
+	apr_uint32_t          reserved;
+	apr_uint64_t          hash;
+	char                  key[ACC_KEY_SIZE];
+} acc_key;
+
+/* The table after the heavy hitters, then the counters of its keys */
+#define SHM_KEYS() ((acc_key*) SHM_HITTERS(ACC_HITTERS))
+#define SHM_KEY_SLOTS() ((acc_slot*) (SHM_KEYS() + shm_header->h.keys))
+
+/* Any server with a key keeps histograms */
+static int key_histograms = 0;
+
+/* Export to a collector
+ *
+ * With AccountingExport a thread in every child wakes up every interval,
+ * and the one that gets to move export_tick on sends the growth of the
+ * aggregated counters since the previous export, as statsd counters in
+ * as few UDP packets as possible. The totals at the previous export are
+ * kept in the segment, after the heavy hitters, as any child may be the
+ * one to do the next export. Requests are never held up by it.
+ */
+#define ACC_EXPORT_DEFAULT_INTERVAL apr_time_from_sec(10)
+#define ACC_EXPORT_DEFAULT_PACKET   1432	/* fits an ethernet frame */
+
+typedef struct {
+	apr_uint64_t requests;
+	apr_uint64_t value[ACC_METRICS];
+} acc_totals;
+
+#define SHM_EXPORTED() ((acc_totals*) (SHM_KEY_SLOTS() + shm_header->h.keys))
+
+/* All servers, to find the slots again in the status handler */
+static server_rec *acc_servers = NULL;
+
+#define ACC_STATUS_HANDLER "accounting-status"
+
+/* Binary accounting log
+ *
+ * With AccountingLog every request appends a fixed size record (see
+ * acc_binlog.h) to a buffer of the child, which is written out in one go
+ * when it's full or older than the flush interval, and when the child
+ * exits. A thread of the child checks the interval as well, so records
+ * don't linger in the buffer of a child that gets no more requests;
+ * without APR threads it's only checked on the next record.
+ *
+ * Writes to a pipe are limited to PIPE_BUF, so records of different
+ * children never get mixed up.
+ */
+#define ACC_BINLOG_DEFAULT_BUFFER   65536
+#define ACC_BINLOG_DEFAULT_INTERVAL apr_time_from_sec(1)
+
+typedef struct {
+	apr_file_t         *file;
+	server_rec         *server;
+	char               *buf;
+	apr_size_t          used;
+	apr_size_t          size;
+	apr_time_t          interval;
+	apr_time_t          flushed;
+#if APR_HAS_THREADS
+	apr_thread_mutex_t *mutex;
+	apr_thread_cond_t  *cond;
+	apr_thread_t       *thread;
+	int                 stop;
+#endif
+} acc_binlog;
+
+static acc_binlog binlog;
+
+/* Lifetime of a child
+ *
+ * With a binary log or aggregated counters every child adds up the CPU
+ * times of its requests, and when it exits it sets them against the
+ * usage of the whole process since it was forked, in an acc_binlog_child
+ * record and in the totals in the shared memory. The difference is what
+ * was spent outside of any request: waiting for keep-alive connections,
+ * restarts, the init of modules and the accounting itself. Sampled
+ * requests count by their weight. Children that are killed don't report.
+ */
+typedef struct {
+	int          enabled;
+	apr_time_t   started;
+	apr_uint64_t requests;
+	apr_uint64_t utime;	/* microseconds */
+	apr_uint64_t stime;
+	apr_uint64_t cutime;
+	apr_uint64_t cstime;
+} acc_lifetime;
+
+static acc_lifetime lifetime;
+
+/* Per child cgroups
+ *
+ * RUSAGE_CHILDREN only includes children that have been waited for. With
+ * AccountingCgroup every child process of httpd moves itself into a leaf
+ * cgroup of its own below a delegated directory, once, in child_init. The
+ * CGI and suexec processes it forks inherit that cgroup, so the cpu.stat
+ * and io.stat of the leaf cover the child and everything it started,
+ * whether it has been reaped or not, and io.stat counts bytes instead of
+ * 512 byte blocks. A request costs a pread() of each of the files, which
+ * are kept open, at its start and end.
+ *
+ * The leaf is shared by all threads of a child, so this only works with a
+ * non-threaded MPM. The child CPU time is what the cgroup used minus what
+ * the child process used itself; the bytes and the memory peak include the
+ * child process itself. memory.peak is reset per open file (Linux 6.12 and
+ * later); without that the peak is left zero.
+ */
+#define ACC_CGROUP_PARENT "httpd"
+
+typedef struct {
+	int cpu_stat;		/* open files of the leaf, or -1 */
+	int io_stat;
+	int memory_peak;
+	int peak_reset;		/* memory.peak can be reset */
+} acc_cgroup;
+
+static acc_cgroup cgroup = { -1, -1, -1, 0 };
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+ #define ACC_ATOMIC_ADD(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+ #define ACC_ATOMIC_LOAD(ptr)     __atomic_load_n((ptr), __ATOMIC_RELAXED)
+ #define ACC_ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#else
+ #define ACC_ATOMIC_ADD(ptr, val) __sync_fetch_and_add((ptr), (val))
+ #define ACC_ATOMIC_LOAD(ptr)     __sync_fetch_and_add((ptr), 0)
+ #define ACC_ATOMIC_STORE(ptr, val) __sync_lock_test_and_set((ptr), (val))
+#endif
 
 /* Some defines that make the logging more readable */
 #define ACC_LOG_REQ_ERROR(errmsg) \
@@ -45,11 +942,30 @@ static const char *notes_key_coublock = "ACC_coublock";
 		errmsg       \
 	)
 
-#define DEBUG 0
+/* Debug tracing
+ *
+ * The trace calls are only compiled in when building with ACC_TRACE defined
+ * (make TRACE=1). Even then they only run when AccountingTrace is enabled
+ * for the server and the log level allows debug messages, which is checked
+ * once before a block of trace calls instead of in every ap_log_error call.
+ */
+#ifndef APLOG_IS_LEVEL
+ #define APLOG_IS_LEVEL(s, level) ((s)->loglevel >= (level))
+#endif
+
+#ifdef ACC_TRACE
+ #define ACC_TRACING(r) (                                                     \
+	((acc_server_conf*) ap_get_module_config(                             \
+		(r)->server->module_config,                                   \
+		&accounting_module                                            \
+	))->trace &&                                                          \
+	APLOG_IS_LEVEL((r)->server, APLOG_DEBUG)                              \
+ )
+#else
+ #define ACC_TRACING(r) 0
+#endif
 
-/* Wether or not the DEBUG macro's should do something */
-#ifdef DEBUG
- #define ACC_LOG_DEBUG_TIME(msg, time) \
+#define ACC_LOG_DEBUG_TIME(msg, time) \
 	ap_log_error(                      \
 		APLOG_MARK,                \
 		APLOG_NOERRNO|APLOG_DEBUG, \
@@ -60,7 +976,7 @@ static const char *notes_key_coublock = "ACC_coublock";
 		time.tv_sec,               \
 		(long int) time.tv_usec    \
 	)
- #define ACC_LOG_DEBUG_BLOCKS(msg, num)    \
+#define ACC_LOG_DEBUG_BLOCKS(msg, num)    \
 	ap_log_error(                      \
 		APLOG_MARK,                \
 		APLOG_NOERRNO|APLOG_DEBUG, \
@@ -70,10 +986,81 @@ static const char *notes_key_coublock = "ACC_coublock";
 		msg,                       \
 		num                        \
 	)
-#else
- #define ACC_LOG_DEBUG_TIME(msg, time) 	/* msg , time */
- #define ACC_LOG_DEBUG_BLOCKS(msg, num) /* msg , num  */
-#endif
+
+/* Anomalies of this process since they were last reported, and when */
+static volatile apr_uint32_t anomaly_counts[ACC_ANOMALIES];
+static volatile apr_uint32_t anomaly_reported = 0;
+
+/* Count an anomaly and report the anomalies once per interval
+ *
+ * A stepped clock or many children finishing at once can make every
+ * request hit an anomaly; logging each of them would flood the error log.
+ * So they're counted per process (and in total in the shared memory, for
+ * the status handler), and one thread per interval logs the counts since
+ * the previous report along with the values of the anomaly at hand.
+ */
+static void report_anomaly(const request_rec *r, int type, apr_int64_t begin, apr_int64_t end){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	apr_uint32_t now, last;
+	apr_uint32_t counts[ACC_ANOMALIES];
+	const char *msg;
+	int i;
+
+	apr_atomic_inc32(&(anomaly_counts[type]));
+
+	if (shm_header)
+		ACC_ATOMIC_ADD(&(shm_header->h.anomalies[type]), 1);
+
+	now = apr_time_sec(apr_time_now());
+	last = apr_atomic_read32(&anomaly_reported);
+
+	if (last && now - last < (apr_uint32_t) conf->anomaly_interval)
+		return;
+
+	/* Some other thread is reporting */
+	if (apr_atomic_cas32(&anomaly_reported, now, last) != last)
+		return;
+
+	for (i = 0; i < ACC_ANOMALIES; i++)
+		counts[i] = apr_atomic_xchg32(&(anomaly_counts[i]), 0);
+
+	if (type == ACC_ANOMALY_TIME)
+	{
+		msg = apr_psprintf(
+			r->pool,
+			"Timetraveling: begin(%ld.%.6ldsec.) end(%ld.%.6ldsec.)",
+			(long int) (begin / 1000000),
+			(long int) (begin % 1000000),
+			(long int) (end / 1000000),
+			(long int) (end % 1000000)
+		);
+	}
+	else if (type == ACC_ANOMALY_BLOCKS)
+	{
+		msg = apr_psprintf(
+			r->pool,
+			"Negative blockcount: begin(%ld blocks) end(%ld blocks)",
+			(long int) begin,
+			(long int) end
+		);
+	}
+	else
+		msg = "Request ended on another thread, its thread CPU time is unknown";
+
+	ap_log_error(
+		APLOG_MARK,
+		APLOG_ERR,
+		APR_SUCCESS,
+		r->server,
+		"%s (%u timetravel, %u negative blockcount and %u thread switch anomalies in %u seconds)",
+		msg,
+		counts[ACC_ANOMALY_TIME],
+		counts[ACC_ANOMALY_BLOCKS],
+		counts[ACC_ANOMALY_THREAD],
+		last ? now - last : 0
+	);
+} // }}}
+
 
 /* Calculate the time difference between begin and end
  *
@@ -97,29 +1084,27 @@ static long int time_difference(const request_rec *r, const struct timeval *begi
 	   )
 	{
 		/* We traveled back in time?!?*/
-		ap_log_error(
-			APLOG_MARK,
-			APLOG_ERR,
-                        APR_SUCCESS,
-			r->server,
-			"Timetraveling: begin(%ld.%.6ldsec.) end(%ld.%.6ldsec.)",
-			begin->tv_sec,
-			(long int) begin->tv_usec,
-			end->tv_sec,
-			(long int) end->tv_usec
+		report_anomaly(
+			r,
+			ACC_ANOMALY_TIME,
+			(apr_int64_t) begin->tv_sec * 1000000 + begin->tv_usec,
+			(apr_int64_t) end->tv_sec * 1000000 + end->tv_usec
 		);
 		return 0;
 	}
 
 	/* Debug */ // {{{
-	ACC_LOG_DEBUG_TIME(
-		"time_difference:begin",
-		(*begin)
-	);
-	ACC_LOG_DEBUG_TIME(
-		"time_difference:end",
-		(*end)
-	); // }}}
+	if (ACC_TRACING(r))
+	{
+		ACC_LOG_DEBUG_TIME(
+			"time_difference:begin",
+			(*begin)
+		);
+		ACC_LOG_DEBUG_TIME(
+			"time_difference:end",
+			(*end)
+		);
+	} // }}}
 
 	/* Calculate the time difference */
 	retval = end->tv_sec - begin->tv_sec;
@@ -133,8 +1118,8 @@ static long int time_difference(const request_rec *r, const struct timeval *begi
 /* Calculate the difference between begin and end values
  *
  * This function determines the difference between two normal getrusage
- * fields. It's is used only for in- and oublock fields. Negative values 
- * should not occur!
+ * fields. It's is used for the block, page fault and context switch
+ * counts. Negative values should not occur!
  */
 static long block_difference(const request_rec *r, long begin, long end){ // {{{
 	long retval;
@@ -143,12 +1128,9 @@ static long block_difference(const request_rec *r, long begin, long end){ // {{{
 	if (begin > end)
 	{
 		/* Difference is negative, shouldn't occur! */
-		ap_log_error(
-			APLOG_MARK,
-			APLOG_ERR,
-                        APR_SUCCESS,
-			r->server,
-			"Negative blockcount: begin(%ld blocks) end(%ld blocks)",
+		report_anomaly(
+			r,
+			ACC_ANOMALY_BLOCKS,
 			begin,
 			end
 		);
@@ -156,14 +1138,17 @@ static long block_difference(const request_rec *r, long begin, long end){ // {{{
 	}
 
 	/* Debug */ // {{{
-	ACC_LOG_DEBUG_BLOCKS(
-		"block_difference:begin",
-		begin
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"block_difference:end",
-		end
-	); // }}}
+	if (ACC_TRACING(r))
+	{
+		ACC_LOG_DEBUG_BLOCKS(
+			"block_difference:begin",
+			begin
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"block_difference:end",
+			end
+		);
+	} // }}}
 
 	/* Calculate the time difference */
 	retval = end - begin;
@@ -174,411 +1159,5208 @@ static long block_difference(const request_rec *r, long begin, long end){ // {{{
 
 
 
-/* Start accounting
+/* Fill a struct rusage from a CPU clock
  *
- * Here we'll retrieve the reference (begin) values that are needed
- * to determine the resource usage of this request.
+ * A clock can't tell user and system time apart, so the total is the user
+ * time and the remaining fields are left zero.
  */
-static int module_accounting_start (request_rec *r){ // {{{
-	/* printf("Module accounting start\n"); */
-	acc_data *data;
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+static int clock_usage(clockid_t id, struct rusage *usage){ // {{{
+	struct timespec ts;
 
-	/* Determine the main request */
-	request_rec *initial = r;
-	while (initial->main)
-		initial = initial->main;
-	
-	/* Determine the first request */
-	while (initial->prev)
-		initial = initial->prev;
+	if (clock_gettime(id, &ts) == -1)
+		return -1;
 
-	/* Check if we've already got reference (begin) timings */
-	if (apr_table_get(initial->notes, notes_key_internal) != NULL)
+	memset(usage, 0, sizeof(*usage));
+	usage->ru_utime.tv_sec = ts.tv_sec;
+	usage->ru_utime.tv_usec = ts.tv_nsec / 1000;
+	return 0;
+} // }}}
+#endif
+
+
+/* Get the resource usage of whatever is serving this request
+ *
+ * Depending on the configured CPU source this is the usage of the whole
+ * process or of the calling thread only. Systems without RUSAGE_THREAD
+ * fall back to the thread CPU clock, as does "AccountingLean On" for a
+ * single clock read instead of a full getrusage().
+ */
+static int own_usage(const request_rec *r, struct rusage *usage){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+	if (conf->lean)
+		return clock_usage(conf->cpu_source == ACC_CPU_THREAD ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, usage);
+#endif
+
+	if (conf->cpu_source != ACC_CPU_THREAD)
+		return getrusage(RUSAGE_SELF, usage);
+
+#if defined(RUSAGE_THREAD)
+	return getrusage(RUSAGE_THREAD, usage);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+	return clock_usage(CLOCK_THREAD_CPUTIME_ID, usage);
+#else
+	return getrusage(RUSAGE_SELF, usage);
+#endif
+} // }}}
+
+
+/* Keep the fields of a struct rusage that are used */
+static void usage_keep(acc_usage *dst, const struct rusage *src){ // {{{
+	dst->utime = src->ru_utime;
+	dst->stime = src->ru_stime;
+	dst->inblock = src->ru_inblock;
+	dst->oublock = src->ru_oublock;
+	dst->minflt = src->ru_minflt;
+	dst->majflt = src->ru_majflt;
+	dst->maxrss = src->ru_maxrss;
+	dst->nvcsw = src->ru_nvcsw;
+	dst->nivcsw = src->ru_nivcsw;
+} // }}}
+
+
+/* Take the begin values of the children of a request
+ *
+ * The children only count once they're reaped, so this can be as late as
+ * just before they're reaped. With "AccountingLean On" it's only done for
+ * requests that are expected to have children: after an
+ * AccountingReapHandler handler, for children registered with
+ * acc_note_child(), or for every request with "AccountingReapChildren
+ * Always". Does nothing when they were taken already.
+ */
+static void child_usage_begin(const request_rec *r, acc_data *data){ // {{{
+	struct rusage usage;
+
+	if (data->begin_child)
+		return;
+
+	if (getrusage(RUSAGE_CHILDREN, &usage) == -1)
 	{
-		/* We already set some reference (begin) values */
-		return DECLINED;
+		/* ERROR */
+		ACC_LOG_REQ_ERROR("Request for children's (begin) resource usage failed");
+		return;
 	}
-	
-	/* Allocate internal message */
-	data = (acc_data*) apr_palloc(initial->pool, sizeof(acc_data));
 
-	/* What's the time since epoch? */
-	if (gettimeofday(&(data->begin_time), NULL) == -1)
+	data->begin_child = apr_palloc(data->initial->pool, sizeof(acc_usage));
+	usage_keep(data->begin_child, &usage);
+} // }}}
+
+
+/* CPU time of the calling thread, in microseconds */
+static apr_int64_t thread_cpu(void){ // {{{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return (apr_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
 	{
-		/* ERROR */
-		ACC_LOG_REQ_ERROR("Request for (begin) time of day failed");
+		struct rusage usage;
+
+		if (getrusage(RUSAGE_SELF, &usage) == -1)
+			return 0;
+
+		return (apr_int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+			usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
 	}
+} // }}}
 
-	/* Get the accumelated resource usage of this process */
-	if (getrusage(RUSAGE_SELF, &(data->begin_own_usage)) == -1)
+
+/* Memory allocated for a request
+ *
+ * APR only keeps count of the bytes in a pool when it's built with pool
+ * debugging, and then pool_bytes is exact: the size of the request pool
+ * and its subpools at the end of the request. Otherwise the allocators of
+ * the pools get their memory from malloc(), and the growth of the heap in
+ * use between the start and the end of the request is what the request
+ * kept allocated. With a threaded MPM that includes the allocations of
+ * requests running at the same time. mallinfo2() locks and walks every
+ * malloc arena, which is why this is a separate group.
+ */
+#if APR_POOL_DEBUG
+#define ACC_POOL_BYTES 1
+#elif defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 33)
+#define ACC_POOL_BYTES 1
+#endif
+#endif
+
+static apr_int64_t heap_in_use(void){ // {{{
+#if !APR_POOL_DEBUG && defined(ACC_POOL_BYTES)
+	struct mallinfo2 info = mallinfo2();
+
+	return (apr_int64_t) (info.uordblks + info.hblkhd);
+#else
+	return 0;
+#endif
+} // }}}
+
+
+static apr_int64_t pool_bytes(const request_rec *initial, const acc_data *data){ // {{{
+#if APR_POOL_DEBUG
+	return (apr_int64_t) apr_pool_num_bytes(initial->pool, 1);
+#else
+	apr_int64_t grown = heap_in_use() - data->optional->begin_heap;
+
+	return grown > 0 ? grown : 0;
+#endif
+} // }}}
+
+
+/* Read a cgroup or /proc file that's kept open
+ *
+ * The files are generated on every read from the start, so a pread() at
+ * offset zero is all it takes.
+ */
+static int stat_read(int fd, char *buf, apr_size_t size){ // {{{
+	ssize_t len;
+
+	if (fd == -1 || (len = pread(fd, buf, size - 1, 0)) < 0)
+		return -1;
+
+	buf[len] = '\0';
+	return 0;
+} // }}}
+
+
+/* Value of a "key value" (cgroup) or "key: value" (/proc) line */
+static apr_int64_t stat_value(const char *buf, const char *key){ // {{{
+	apr_size_t len = strlen(key);
+	const char *line;
+
+	for (line = buf; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL)
 	{
-		/* ERROR */
-		ACC_LOG_REQ_ERROR("Request for (begin) resource usage failed");
+		if (!strncmp(line, key, len) && (line[len] == ' ' || line[len] == ':'))
+			return apr_strtoi64(line + len + 1, NULL, 10);
 	}
 
-	/* Get the accumelated resource usage for childeren of this process */
-	if (getrusage(RUSAGE_CHILDREN, &(data->begin_child_usage)) == -1)
+	return 0;
+} // }}}
+
+
+/* Sum of a "key=value" field over the devices in io.stat */
+static apr_int64_t cgroup_io_stat(const char *buf, const char *key){ // {{{
+	apr_size_t len = strlen(key);
+	apr_int64_t sum = 0;
+	const char *c;
+
+	for (c = buf; (c = strstr(c, key)) != NULL; c += len)
 	{
-		/* ERROR */
-		ACC_LOG_REQ_ERROR("Request for children's (begin) resource usage failed");
+		if ((c == buf || c[-1] == ' ') && c[len] == '=')
+			sum += apr_strtoi64(c + len + 1, NULL, 10);
 	}
 
-	/* Add zero padding to structure */
-	data->zero = '\0';
+	return sum;
+} // }}}
 
-	/* Debug */ // {{{
-	ACC_LOG_DEBUG_TIME(
-		"accounting_start:data->begin_time",
-		data->begin_time
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_start:data->begin_own_usage.ru_utime",
-		data->begin_own_usage.ru_utime
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_start:data->begin_own_usage.ru_stime",
-		data->begin_own_usage.ru_stime
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_start:data->begin_own_usage.ru_inblock",
-		data->begin_own_usage.ru_inblock
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_start:data->begin_own_usage.ru_oublock",
-		data->begin_own_usage.ru_oublock
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_start:data->begin_child_usage.ru_utime",
-		data->begin_child_usage.ru_utime
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_start:data->begin_child_usage.ru_stime",
-		data->begin_child_usage.ru_stime
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_start:data->begin_child_usage.ru_inblock",
-		data->begin_child_usage.ru_inblock
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_start:data->begin_child_usage.ru_oublock",
-		data->begin_child_usage.ru_oublock
-	); // }}}
 
-	/* Add this data as to the notes field of request_rec */
-	apr_table_setn(initial->notes, notes_key_internal, (char*) data);
+/* Current usage of the cgroup of this child */
+static int cgroup_usage(acc_cgroup_usage *usage){ // {{{
+	char buf[4096];
 
-	/* We're not a final handler */
-	return DECLINED;
+	if (stat_read(cgroup.cpu_stat, buf, sizeof(buf)) == -1)
+		return -1;
+
+	usage->user = stat_value(buf, "user_usec");
+	usage->system = stat_value(buf, "system_usec");
+
+	/* Without the io controller there's nothing to read */
+	usage->rbytes = usage->wbytes = 0;
+	if (stat_read(cgroup.io_stat, buf, sizeof(buf)) == 0)
+	{
+		usage->rbytes = cgroup_io_stat(buf, "rbytes");
+		usage->wbytes = cgroup_io_stat(buf, "wbytes");
+	}
+
+	return 0;
 } // }}}
 
 
-/* Stop accounting
+/* Start a new memory peak for the open memory.peak file */
+static void cgroup_reset_peak(void){ // {{{
+	if (cgroup.peak_reset && pwrite(cgroup.memory_peak, "reset\n", 6, 0) == -1)
+		cgroup.peak_reset = 0;
+} // }}}
+
+
+/* Memory peak since cgroup_reset_peak(), in bytes */
+static apr_int64_t cgroup_peak(void){ // {{{
+	char buf[64];
+
+	if (!cgroup.peak_reset || stat_read(cgroup.memory_peak, buf, sizeof(buf)) == -1)
+		return 0;
+
+	return apr_strtoi64(buf, NULL, 10);
+} // }}}
+
+
+/* I/O of the calling thread
  *
- * Here we will request the resource information at the end of the period
- * we want to account. Using the reference (begin) values we retrieved in
- * the module_acccounting_start() function we can now determine the resource
- * usage of this request.
+ * /proc/thread-self/io counts all reads and writes of the thread (rchar,
+ * wchar, including network and page cache hits), the number of calls, and
+ * the bytes that caused storage I/O (read_bytes and write_bytes, which
+ * includes NFS). It's per thread, unlike the block counts of RUSAGE_SELF,
+ * and in bytes. Every thread keeps the file open after its first request,
+ * so a snapshot is a single pread(). Systems before Linux 3.17 only have
+ * /proc/self/io, which is fine for non-threaded MPMs.
+ *
+ * The file can't be opened by a process that isn't dumpable, which is
+ * what httpd children are after switching users, unless CoreDumpDirectory
+ * is set. io_failed turns the backend off after the first failure.
  */
-static int module_accounting_stop(request_rec *r) { // {{{
-	/* printf("Module accounting stop\n"); */
-	struct timeval end_time;
-	struct rusage  end_own_usage;
-	struct rusage  end_child_usage;
+static const char *io_keys[ACC_IO_KEYS] = {
+	"rchar",
+	"wchar",
+	"syscr",
+	"syscw",
+	"read_bytes",
+	"write_bytes"
+};
+
+#if defined(__GNUC__)
+static __thread int io_fd = -1;
+#define ACC_IO_FD io_fd
+#else
+#define ACC_IO_FD -1
+#endif
+
+static volatile apr_uint32_t io_failed = 0;
+
+static int thread_io(const request_rec *r, acc_io *io){ // {{{
+	char buf[512];
+	int fd = ACC_IO_FD;
+	int i;
+
+	if (io_failed)
+		return -1;
+
+	if (fd == -1 &&
+		(fd = open("/proc/thread-self/io", O_RDONLY)) == -1 &&
+		(fd = open("/proc/self/io", O_RDONLY)) == -1)
+	{
+		if (apr_atomic_cas32(&io_failed, 1, 0) == 0)
+		{
+			ap_log_error(
+				APLOG_MARK,
+				APLOG_WARNING,
+				APR_FROM_OS_ERROR(errno),
+				r->server,
+				"Failed to open /proc/thread-self/io, AccountingThreadIO disabled"
+			);
+		}
+		return -1;
+	}
+
+	i = stat_read(fd, buf, sizeof(buf));
+
+#if defined(__GNUC__)
+	io_fd = fd;
+#else
+	close(fd);
+#endif
+
+	if (i == -1)
+		return -1;
+
+	for (i = 0; i < ACC_IO_KEYS; i++)
+		io->value[i] = stat_value(buf, io_keys[i]);
+
+	return 0;
+} // }}}
+
+
+/* Read the configured clock
+ *
+ * For the begin time of a request (begin is set) the "request" clock is
+ * the time the request was read, for the end time it's the time of day.
+ */
+static int wall_clock(const request_rec *r, int begin, struct timeval *tv){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	struct timespec ts;
+	clockid_t id;
+
+	switch (conf->clock)
+	{
+		case ACC_CLOCK_REQUEST:
+			if (!begin)
+				return gettimeofday(tv, NULL);
+
+			tv->tv_sec = apr_time_sec(r->request_time);
+			tv->tv_usec = apr_time_usec(r->request_time);
+			return 0;
+
+		case ACC_CLOCK_MONOTONIC:
+			id = CLOCK_MONOTONIC;
+			break;
+
+		case ACC_CLOCK_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+			id = CLOCK_MONOTONIC_COARSE;
+#else
+			id = CLOCK_MONOTONIC;
+#endif
+			break;
+
+		default:
+			return gettimeofday(tv, NULL);
+	}
+
+	if (clock_gettime(id, &ts) == -1)
+		return -1;
+
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	return 0;
+} // }}}
+
+
+/* Sampling
+ *
+ * With "AccountingSampleRate N" only every Nth request of a child is
+ * measured in full, and counts N times in the aggregated counters. The
+ * others are only reported with AccountingSlowThreshold, when they took
+ * at least that long, with just their time since the request was read.
+ * Requests that are reported have the ACCOUNTING environment variable set
+ * to "sampled" or "slow", for "CustomLog ... env=ACCOUNTING".
+ */
+#define ACC_SAMPLE_ENV "ACCOUNTING"
+
+static volatile apr_uint32_t sample_count = 0;
+
+
+/* Start a request on the connection
+ *
+ * Returns the usage at the end of the previous request when it can be
+ * taken as the begin values of this one, else NULL. Either way it's used
+ * up, see acc_conn.
+ */
+static const acc_conn *conn_snapshot_take(request_rec *r, const acc_server_conf *conf, apr_uint32_t *seq){ // {{{
+	acc_conn *conn = ap_get_module_config(r->connection->conn_config, &accounting_module);
+	int valid;
+
+	*seq = 0;
+
+	if (conn == NULL)
+	{
+		if (!conf->conn_snapshot)
+			return NULL;
+
+		conn = apr_pcalloc(r->connection->pool, sizeof(acc_conn));
+		ap_set_module_config(r->connection->conn_config, &accounting_module, conn);
+	}
+
+	/* Counted for every request, also when the server of this one
+	 * doesn't keep snapshots */
+	*seq = ++conn->seq;
+
+	valid = conn->valid && conf->conn_snapshot && conn->cpu_source == conf->cpu_source && conn->lean == conf->lean;
+#if APR_HAS_THREADS
+	if (valid && conf->cpu_source == ACC_CPU_THREAD)
+		valid = apr_os_thread_equal(conn->thread, apr_os_thread_current());
+#endif
+
+	conn->valid = 0;
+
+	return valid ? conn : NULL;
+} // }}}
+
+
+/* Keep the usage at the end of a request for the next one, child_usage
+ * is NULL when the children weren't measured */
+static void conn_snapshot_keep(request_rec *r, const acc_server_conf *conf, const acc_data *data, const struct rusage *own_usage, const struct rusage *child_usage){ // {{{
+	acc_conn *conn = ap_get_module_config(r->connection->conn_config, &accounting_module);
+
+	/* Another request already started */
+	if (conn == NULL || !data->seq || conn->seq != data->seq)
+		return;
+
+	conn->cpu_source = conf->cpu_source;
+	conn->lean = conf->lean;
+#if APR_HAS_THREADS
+	conn->thread = apr_os_thread_current();
+#endif
+	usage_keep(&(conn->own_usage), own_usage);
+	if ((conn->child = child_usage != NULL))
+		usage_keep(&(conn->child_usage), child_usage);
+	conn->valid = 1;
+} // }}}
+
+
+/* Intern a key in the table, returns its id or 0 when it doesn't fit
+ *
+ * Spaces and control characters are replaced, so keys can be printed as
+ * they are in the text status output.
+ */
+static apr_uint32_t key_intern(const char *value){ // {{{
+	char key[ACC_KEY_SIZE];
+	apr_uint64_t hash = 14695981039346656037ULL;
+	apr_uint32_t mask = shm_header->h.keys - 1;
+	apr_uint32_t i, index, state;
+	acc_key *entry;
+	int spin;
+
+	for (i = 0; value[i] && i < ACC_KEY_SIZE - 1; i++)
+	{
+		key[i] = apr_isgraph(value[i]) ? value[i] : '_';
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ULL;
+	}
+	key[i] = '\0';
+
+	if (i == 0)
+		return 0;
+
+	for (i = 0; i < ACC_KEY_PROBES && i <= mask; i++)
+	{
+		index = (apr_uint32_t) (hash + i) & mask;
+		entry = &(SHM_KEYS()[index]);
+		state = apr_atomic_read32(&(entry->state));
+
+		/* A free entry ends the probe, it's ours if we get to claim it */
+		if (state == ACC_KEY_FREE)
+		{
+			state = apr_atomic_cas32(&(entry->state), ACC_KEY_CLAIMED, ACC_KEY_FREE);
+
+			if (state == ACC_KEY_FREE)
+			{
+				entry->hash = hash;
+				apr_cpystrn(entry->key, key, ACC_KEY_SIZE);
+				apr_atomic_set32(&(entry->state), ACC_KEY_READY);
+				return index + 1;
+			}
+		}
+
+		/* Claimed by another child that's writing its key right now, or
+		 * one that died doing so, which happens to stay in a state file */
+		for (spin = 0; state == ACC_KEY_CLAIMED && spin < ACC_HITTER_SPIN; spin++)
+			state = apr_atomic_read32(&(entry->state));
+
+		if (state == ACC_KEY_READY && entry->hash == hash && !strcmp(entry->key, key))
+			return index + 1;
+	}
+
+	ACC_ATOMIC_ADD(&(shm_header->h.keys_dropped), 1);
+	return 0;
+} // }}}
+
+
+/* Name of the key with an id
+ *
+ * The id may come from a torn copy of a heavy hitter, so it's checked
+ * against the table; one that isn't in it, or isn't written out yet, is
+ * unknown, like the name of a server that's gone.
+ */
+static const char *key_name(apr_uint32_t id){ // {{{
+	const acc_key *entry;
+
+	if (id == 0 || id > shm_header->h.keys)
+		return "-";
+
+	entry = &(SHM_KEYS()[id - 1]);
+	if (apr_atomic_read32((volatile apr_uint32_t*) &(entry->state)) != ACC_KEY_READY)
+		return "-";
+
+	return entry->key;
+} // }}}
+
+
+/* Look up the key of a request when its source is known by now
+ *
+ * The name of the virtual host and the request headers are known when
+ * the request starts, environment variables and the suexec user only
+ * after the fixups of others, so those are looked up at the end of the
+ * fixups, of every request of the chain until one has it.
+ */
+static void key_resolve(request_rec *r, acc_data *data, int fixups){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	const char *value = NULL;
+	char uid[32];
+
+	if (data->key || !data->weight || shm_header == NULL || !shm_header->h.keys)
+		return;
+
+	switch (conf->key_source)
+	{
+		case ACC_KEY_VHOST:
+			value = r->server->server_hostname;
+			break;
+
+		case ACC_KEY_HEADER:
+			value = apr_table_get(r->headers_in, conf->key_name);
+			break;
+
+		case ACC_KEY_ENV:
+			if (fixups)
+				value = apr_table_get(r->subprocess_env, conf->key_name);
+			break;
+
+		case ACC_KEY_USER:
+			if (fixups)
+			{
+				ap_unix_identity_t *identity = ap_run_get_suexec_identity(r);
+
+				if (identity)
+				{
+					apr_snprintf(uid, sizeof(uid), "%ld", (long) identity->uid);
+					value = uid;
+				}
+			}
+			break;
+	}
+
+	if (value)
+		data->key = key_intern(value);
+} // }}}
+
+
+/* The optional state of a request, allocated when it's first written */
+static acc_optional *data_optional(acc_data *data){ // {{{
+	if (data->optional == &no_optional)
+	{
+		data->optional = apr_pcalloc(data->initial->pool, sizeof(acc_optional));
+		data->optional->ttfb = -1;	/* nothing was sent yet */
+	}
+
+	return data->optional;
+} // }}}
+
+
+/* Start accounting
+ *
+ * Here we'll retrieve the reference (begin) values that are needed
+ * to determine the resource usage of this request.
+ */
+static int module_accounting_start (request_rec *r){ // {{{
+	/* printf("Module accounting start\n"); */
 	acc_data *data;
-	
-	/* Resolve the internal redirect request */
-	request_rec *initial;
-	request_rec *last;
-	
+	const acc_conn *snapshot;
+	apr_uint32_t seq;
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	const acc_dir_conf *dconf = ap_get_module_config(r->per_dir_config, &accounting_module);
+
 	/* Determine the main request */
-	initial = r;
+	request_rec *initial = r;
 	while (initial->main)
 		initial = initial->main;
-	last = initial;
-
+	
 	/* Determine the first request */
 	while (initial->prev)
 		initial = initial->prev;
 
-	/* Determine the last request */
-	while (last->next)
-		last = last->next;
-	
-	/* Get the reference (begin) data */
-	if ((data = (acc_data*) apr_table_get(initial->notes, notes_key_internal)) == NULL)
+	/* Check if we've already got reference (begin) timings */
+	if (ap_get_module_config(initial->request_config, &accounting_module) != NULL)
 	{
-		/* Internal data missing ?!? */
-		ACC_LOG_REQ_ERROR("Failed to fetch internal data!");
-
+		/* We already set some reference (begin) values */
 		return DECLINED;
 	}
+
+	/* The end of the previous request on the connection, which a request
+	 * that isn't measured makes useless for the next one too */
+	snapshot = conn_snapshot_take(initial, conf, &seq);
+
+	/* Switched off for the whole server? */
+	if (!dconf->enabled)
+		return DECLINED;
 	
-	/* Request resource information at this point */
+	/* Allocate internal message */
+	data = (acc_data*) apr_pcalloc(initial->pool, sizeof(acc_data));
+	data->initial = initial;
+	data->seq = seq;
+	data->optional = &no_optional;
+
+	/* Requests that aren't sampled only get their time, at the end */
+	if (conf->sample_rate > 1 && apr_atomic_inc32(&sample_count) % conf->sample_rate)
+	{
+		data->weight = 0;
+		ap_set_module_config(initial->request_config, &accounting_module, data);
+		return DECLINED;
+	}
+
+	data->weight = conf->sample_rate;
+	data->thread = thread_self();
 
-	/* Try waiting for children */
-	wait4(-1, NULL, WNOHANG, NULL);
+	/* The key, if the request already tells */
+	if (conf->key_source > ACC_KEY_NONE)
+		key_resolve(r, data, 0);
 
-	/* What's the time since epoch? */
-	if (gettimeofday(&(end_time), NULL) == -1)
+	/* What's the time? */
+	if (wall_clock(r, 1, &(data->begin_time)) == -1)
 	{
 		/* ERROR */
-		ACC_LOG_REQ_ERROR("Request for (end) time of day failed");
+		ACC_LOG_REQ_ERROR("Request for (begin) time failed");
 	}
 
-	/* Get the accumelated resource usage of this process */
-	if (getrusage(RUSAGE_SELF, &(end_own_usage)) == -1)
+	/* The previous request on the connection already got the usage */
+	if (snapshot)
+		data->begin_own = snapshot->own_usage;
+	else
 	{
-		/* ERROR */
-		ACC_LOG_REQ_ERROR("Request for (end) resource usage failed");
+		struct rusage usage;
+
+		/* Get the accumelated resource usage of this process */
+		if (own_usage(r, &usage) == -1)
+		{
+			/* ERROR */
+			ACC_LOG_REQ_ERROR("Request for (begin) resource usage failed");
+		}
+
+		usage_keep(&(data->begin_own), &usage);
 	}
 
-	/* Get the accumelated resource usage for childeren of this process */
-	if (getrusage(RUSAGE_CHILDREN, &(end_child_usage)) == -1)
+	/* No children and results yet */
+	data->reap_any = 0;
+	data->children = NULL;
+	data->result = NULL;
+
+	/* Get the accumelated resource usage for childeren of this process,
+	 * unless it's only taken when children are expected */
+	data->begin_child = NULL;
+	if (snapshot && snapshot->child && !conf->lean)
 	{
-		/* ERROR */
-		ACC_LOG_REQ_ERROR("Request for children's (end) resource usage failed");
+		data->begin_child = apr_palloc(initial->pool, sizeof(acc_usage));
+		*(data->begin_child) = snapshot->child_usage;
 	}
+	else if (!conf->lean || conf->reap == ACC_REAP_ALWAYS)
+		child_usage_begin(r, data);
 
-	/* Debug */ // {{{
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:data->begin_time",
-		data->begin_time
+	/* Room for what's configured on top of that */
+	if (conf->phases || conf->bytes || conf->memory || conf->thread_io
+		|| cgroup.cpu_stat != -1 || conf->subrequests || conf->backend)
+		data_optional(data);
+
+	/* The memory in use so far */
+	if (conf->memory)
+		data->optional->begin_heap = heap_in_use();
+
+	/* The I/O of this thread */
+	if (conf->thread_io)
+	{
+		acc_io io;
+
+		if (thread_io(r, &io) == 0)
+		{
+			data->optional->begin_io = apr_palloc(initial->pool, sizeof(acc_io));
+			*(data->optional->begin_io) = io;
+		}
+	}
+
+	/* And of the cgroup this child and its children are in */
+	if (cgroup.cpu_stat != -1)
+	{
+		acc_cgroup_usage usage;
+
+		if (cgroup_usage(&usage) == 0)
+		{
+			data->optional->begin_cgroup = apr_palloc(initial->pool, sizeof(acc_cgroup_usage));
+			*(data->optional->begin_cgroup) = usage;
+		}
+
+		cgroup_reset_peak();
+	}
+
+	/* The first phase starts now */
+	if (conf->phases)
+	{
+		data->optional->phases = apr_pcalloc(initial->pool, sizeof(acc_phases));
+		data->optional->phases->current = ACC_PHASE_READ;
+		data->optional->phases->wall = data->begin_time;
+		data->optional->phases->thread = data->thread;
+		data->optional->phases->cpu = thread_cpu();
+	}
+
+	/* Debug */ // {{{
+	if (ACC_TRACING(r))
+	{
+		ACC_LOG_DEBUG_TIME(
+			"accounting_start:data->begin_time",
+			data->begin_time
+		);
+		ACC_LOG_DEBUG_TIME(
+			"accounting_start:data->begin_own.utime",
+			data->begin_own.utime
+		);
+		ACC_LOG_DEBUG_TIME(
+			"accounting_start:data->begin_own.stime",
+			data->begin_own.stime
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"accounting_start:data->begin_own.inblock",
+			data->begin_own.inblock
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"accounting_start:data->begin_own.oublock",
+			data->begin_own.oublock
+		);
+
+		if (data->begin_child)
+		{
+			ACC_LOG_DEBUG_TIME(
+				"accounting_start:data->begin_child->utime",
+				data->begin_child->utime
+			);
+			ACC_LOG_DEBUG_TIME(
+				"accounting_start:data->begin_child->stime",
+				data->begin_child->stime
+			);
+			ACC_LOG_DEBUG_BLOCKS(
+				"accounting_start:data->begin_child->inblock",
+				data->begin_child->inblock
+			);
+			ACC_LOG_DEBUG_BLOCKS(
+				"accounting_start:data->begin_child->oublock",
+				data->begin_child->oublock
+			);
+		}
+	} // }}}
+
+	/* Keep this data with the request */
+	ap_set_module_config(initial->request_config, &accounting_module, data);
+
+	/* We're not a final handler */
+	return DECLINED;
+} // }}}
+
+
+/* Find the (begin) reference values of the request
+ *
+ * Every other request of the chain caches them in its own request_config
+ * on the first lookup, so the hooks and filters of long internal
+ * redirect chains and their subrequests don't walk the chain each time.
+ */
+static acc_data *request_data(const request_rec *r){ // {{{
+	const request_rec *initial = r;
+	acc_data *data;
+
+	if ((data = ap_get_module_config(r->request_config, &accounting_module)) != NULL)
+		return data;
+
+	while (initial->main)
+		initial = initial->main;
+
+	while (initial->prev)
+		initial = initial->prev;
+
+	if (initial != r && (data = ap_get_module_config(initial->request_config, &accounting_module)) != NULL)
+		ap_set_module_config(r->request_config, &accounting_module, data);
+
+	return data;
+} // }}}
+
+
+/* Find the results of a request
+ *
+ * They're kept with the first request of the internal redirect chain of
+ * the main request. Returns NULL when the request isn't accounted (yet).
+ */
+static const acc_result *request_result(const request_rec *r){ // {{{
+	const acc_data *data = request_data(r);
+
+	return data ? data->result : NULL;
+} // }}}
+
+
+/* Find the last request of the internal redirect chain */
+static request_rec *last_request(request_rec *r){ // {{{
+	while (r->main)
+		r = r->main;
+
+	while (r->next)
+		r = r->next;
+
+	return r;
+} // }}}
+
+
+/* Copy the results to the notes table
+ *
+ * This is what %{ACC_...}n log format items and other modules read, but
+ * it costs an allocation and a table entry per metric, so it can be
+ * switched off with "AccountingNotes Off" when only %{...}Z is used.
+ */
+static void set_notes(request_rec *last, const acc_result *res){ // {{{
+	int i;
+
+	for (i = 0; i < ACC_METRICS; i++)
+	{
+		if (!REPORTED(res, i))
+			continue;
+
+		apr_table_setn(
+			last->notes,
+			metrics[i].notes_key,
+			apr_psprintf(
+				last->pool,
+				"%" APR_INT64_T_FMT,
+				res->value[i]
+			)
+		);
+	}
+} // }}}
+
+
+/* Handler for the %{name}Z log format item
+ *
+ * Only the metrics that are actually used by a LogFormat get formatted,
+ * directly from the results of module_accounting_stop().
+ */
+static const char *log_accounting_item(request_rec *r, char *a){ // {{{
+	const acc_result *res;
+	const acc_data *data;
+	int i;
+
+	if ((res = request_result(r)) == NULL)
+		return NULL;
+
+	/* Not a metric, see subrequest_summary() */
+	if (!strcmp(a, "subrequests"))
+	{
+		data = request_data(r);
+		return data->optional->subrequests_summary;
+	}
+
+	for (i = 0; i < ACC_METRICS; i++)
+	{
+		if (!strcmp(a, metrics[i].name))
+			return REPORTED(res, i) ? apr_psprintf(r->pool, "%" APR_INT64_T_FMT, res->value[i]) : NULL;
+	}
+
+	return NULL;
+} // }}}
+
+
+/* Optional function acc_get_value(), see mod_accounting.h */
+static int acc_get_value(const request_rec *r, const char *name, apr_int64_t *value){ // {{{
+	const acc_result *res;
+	int i;
+
+	if ((res = request_result(r)) == NULL)
+		return DECLINED;
+
+	for (i = 0; i < ACC_METRICS; i++)
+	{
+		if (!strcmp(name, metrics[i].name))
+		{
+			if (!REPORTED(res, i))
+				return DECLINED;
+
+			*value = res->value[i];
+			return OK;
+		}
+	}
+
+	return DECLINED;
+} // }}}
+
+
+/* Optional function acc_note_child(), see mod_accounting.h */
+static void acc_note_child(const request_rec *r, pid_t pid){ // {{{
+	acc_data *data;
+
+	if ((data = request_data(r)) == NULL)
+		return;
+
+	/* Not reaped yet, so it doesn't count yet */
+	if (data->weight)
+		child_usage_begin(r, data);
+
+	/* r may be a subrequest, whose pool is gone by the end */
+	if (data->children == NULL)
+		data->children = apr_array_make(data->initial->pool, 1, sizeof(pid_t));
+
+	APR_ARRAY_PUSH(data->children, pid_t) = pid;
+} // }}}
+
+
+/* End the current phase and start the next one
+ *
+ * Uses the thread CPU clock, which is cheaper than a full getrusage().
+ * Going back in time is already reported for the request as a whole, so
+ * here it's silently taken as no time at all, and so is the CPU time of a
+ * phase that ended on another thread.
+ */
+static void phase_switch(const request_rec *r, acc_phases *phases, int next){ // {{{
+	struct timeval now;
+	apr_int64_t cpu = thread_cpu();
+	acc_thread thread = thread_self();
+	apr_int64_t elapsed;
+
+	if (wall_clock(r, 0, &now) == -1)
+		now = phases->wall;
+
+	elapsed = (apr_int64_t) (now.tv_sec - phases->wall.tv_sec) * 1000000 + now.tv_usec - phases->wall.tv_usec;
+
+	if (elapsed > 0)
+		phases->time[phases->current] += elapsed;
+	if (cpu > phases->cpu && thread_same(thread, phases->thread))
+		phases->cpu_time[phases->current] += cpu - phases->cpu;
+
+	phases->current = next;
+	phases->wall = now;
+	phases->thread = thread;
+	phases->cpu = cpu;
+} // }}}
+
+
+/* Mark the start of a phase of a main request */
+static void phase_mark(const request_rec *r, int phase){ // {{{
+	acc_data *data;
+
+	if (r->main)
+		return;
+
+	if ((data = request_data(r)) == NULL || data->optional->phases == NULL)
+		return;
+
+	phase_switch(r, data->optional->phases, phase);
+} // }}}
+
+
+static int module_accounting_translate(request_rec *r){ // {{{
+	phase_mark(r, ACC_PHASE_TRANSLATE);
+	return DECLINED;
+} // }}}
+
+
+static int module_accounting_map(request_rec *r){ // {{{
+	phase_mark(r, ACC_PHASE_MAP);
+	return DECLINED;
+} // }}}
+
+
+static int module_accounting_access(request_rec *r){ // {{{
+	phase_mark(r, ACC_PHASE_AUTH);
+	return DECLINED;
+} // }}}
+
+
+static int module_accounting_fixups(request_rec *r){ // {{{
+	phase_mark(r, ACC_PHASE_FIXUPS);
+	return DECLINED;
+} // }}}
+
+
+/* Look up keys that depend on the fixups of other modules */
+static int module_accounting_key(request_rec *r){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	acc_data *data;
+
+	if (conf->key_source != ACC_KEY_ENV && conf->key_source != ACC_KEY_USER)
+		return DECLINED;
+
+	/* Subrequests count for the key of their main request */
+	if (r->main || (data = request_data(r)) == NULL)
+		return DECLINED;
+
+	key_resolve(r, data, 1);
+
+	return DECLINED;
+} // }}}
+
+
+/* Microseconds between two times, or zero if end is before begin */
+static apr_int64_t elapsed(const struct timeval *begin, const struct timeval *end){ // {{{
+	apr_int64_t usec = (apr_int64_t) (end->tv_sec - begin->tv_sec) * 1000000 + end->tv_usec - begin->tv_usec;
+
+	return usec > 0 ? usec : 0;
+} // }}}
+
+
+/* Parse the CPU usage a backend reported
+ *
+ * The header holds "utime=<usec> stime=<usec>" (either may be left out,
+ * separated by spaces or commas), or just the total in microseconds, which
+ * is then counted as user time.
+ */
+static void backend_parse_usage(acc_backend *backend, const char *value){ // {{{
+	char *end;
+	apr_int64_t usec;
+
+	while (*value)
+	{
+		while (*value == ' ' || *value == ',' || *value == ';')
+			value++;
+
+		if (!strncasecmp(value, "utime=", 6))
+		{
+			usec = apr_strtoi64(value + 6, &end, 10);
+			backend->utime += usec > 0 ? usec : 0;
+		}
+		else if (!strncasecmp(value, "stime=", 6))
+		{
+			usec = apr_strtoi64(value + 6, &end, 10);
+			backend->stime += usec > 0 ? usec : 0;
+		}
+		else if (*value >= '0' && *value <= '9')
+		{
+			usec = apr_strtoi64(value, &end, 10);
+			backend->utime += usec > 0 ? usec : 0;
+		}
+		else
+			return;
+
+		if (end == value)
+			return;
+
+		value = end;
+	}
+} // }}}
+
+
+/* Take the backend's usage header out of the response */
+static void backend_take_header(request_rec *r, acc_backend *backend){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	const char *value;
+
+	if (conf->backend_header == NULL)
+		return;
+
+	if ((value = apr_table_get(r->headers_out, conf->backend_header)) != NULL)
+	{
+		backend_parse_usage(backend, value);
+		apr_table_unset(r->headers_out, conf->backend_header);
+	}
+
+	if ((value = apr_table_get(r->err_headers_out, conf->backend_header)) != NULL)
+	{
+		backend_parse_usage(backend, value);
+		apr_table_unset(r->err_headers_out, conf->backend_header);
+	}
+} // }}}
+
+
+/* Start timing a backend */
+static int module_accounting_proxy_pre(proxy_worker **worker, proxy_balancer **balancer, request_rec *r, proxy_server_conf *pconf, char **url){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	acc_data *data;
+
+	if (!conf->backend || (data = request_data(r)) == NULL || !data->weight)
+		return DECLINED;
+
+	/* With the request it's kept for, r may be a proxied subrequest */
+	if (data_optional(data)->backend == NULL)
+		data->optional->backend = apr_pcalloc(data->initial->pool, sizeof(acc_backend));
+
+	/* Retries of the same request keep the first start */
+	if (!data->optional->backend->active)
+	{
+		data->optional->backend->active = 1;
+		wall_clock(r, 0, &(data->optional->backend->start));
+	}
+
+	return DECLINED;
+} // }}}
+
+
+/* Stop timing a backend */
+static int module_accounting_proxy_post(proxy_worker *worker, proxy_balancer *balancer, request_rec *r, proxy_server_conf *pconf){ // {{{
+	acc_data *data;
+	struct timeval now;
+
+	if ((data = request_data(r)) == NULL || data->optional->backend == NULL || !data->optional->backend->active)
+		return DECLINED;
+
+	wall_clock(r, 0, &now);
+	data->optional->backend->time += elapsed(&(data->optional->backend->start), &now);
+	data->optional->backend->active = 0;
+
+	/* Responses without a body never reach the output filters */
+	backend_take_header(r, data->optional->backend);
+
+	return DECLINED;
+} // }}}
+
+
+/* Begin of a subrequest, see acc_subrequest */
+typedef struct {
+	request_rec   *r;
+	acc_data      *data;
+	struct timeval begin;
+	acc_thread     thread;
+	apr_int64_t    cpu;
+} acc_subrequest_begin;
+
+
+/* End of a subrequest, when its pool is destroyed */
+static apr_status_t subrequest_end(void *arg){ // {{{
+	acc_subrequest_begin *begin = arg;
+	acc_data *data = begin->data;
+	const acc_server_conf *conf = ap_get_module_config(begin->r->server->module_config, &accounting_module);
+	acc_optional *optional;
+	acc_subrequest *sub;
+	struct timeval now;
+	apr_int64_t cpu = thread_cpu();
+
+	/* Left for the request pool, after the request was logged */
+	if (data->result)
+		return APR_SUCCESS;
+
+	optional = data_optional(data);
+	if (optional->subrequests == NULL)
+		optional->subrequests = apr_array_make(data->initial->pool, 4, sizeof(acc_subrequest));
+
+	if (optional->subrequests->nelts >= conf->subrequests)
+	{
+		optional->subrequests_dropped++;
+		return APR_SUCCESS;
+	}
+
+	if (wall_clock(begin->r, 0, &now) == -1)
+		now = begin->begin;
+
+	sub = (acc_subrequest*) apr_array_push(optional->subrequests);
+	sub->uri = ap_escape_uri(data->initial->pool, begin->r->uri ? begin->r->uri : "");
+	sub->status = begin->r->status;
+	sub->time = elapsed(&(begin->begin), &now);
+	sub->cpu = cpu > begin->cpu && thread_same(begin->thread, thread_self()) ? cpu - begin->cpu : 0;
+
+	return APR_SUCCESS;
+} // }}}
+
+
+/* Begin timing a subrequest
+ *
+ * This runs for every request_rec that's created, ap_sub_req_*() ones
+ * included. The thread CPU clock is a lot cheaper than getrusage(), and a
+ * subrequest runs on the thread of its main request, unless its pool is
+ * only destroyed with that of the main request; its CPU time is then 0.
+ */
+static int module_accounting_create_request(request_rec *r){ // {{{
+	const acc_server_conf *conf;
+	acc_subrequest_begin *begin;
+	acc_data *data;
+
+	/* An internal redirect of a subrequest shares its pool, so it's
+	 * already timed with the subrequest it came from */
+	if (r->main == NULL || r->main->main != NULL || r->prev != NULL)
+		return DECLINED;
+
+	conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	if (!conf->subrequests)
+		return DECLINED;
+
+	if ((data = request_data(r)) == NULL || !data->weight || data->result)
+		return DECLINED;
+
+	begin = apr_palloc(r->pool, sizeof(acc_subrequest_begin));
+	begin->r = r;
+	begin->data = data;
+
+	if (wall_clock(r, 0, &(begin->begin)) == -1)
+		return DECLINED;
+
+	begin->thread = thread_self();
+	begin->cpu = thread_cpu();
+
+	apr_pool_cleanup_register(r->pool, begin, subrequest_end, apr_pool_cleanup_null);
+
+	return DECLINED;
+} // }}}
+
+
+/* One line with the subrequests of a request
+ *
+ * "<time>:<cpu>:<status>:<uri>" per subrequest, in microseconds and in the
+ * order they ended, separated by spaces, and "+<n>" for the subrequests
+ * that didn't fit in AccountingSubrequests.
+ */
+static const char *subrequest_summary(apr_pool_t *p, const acc_data *data){ // {{{
+	apr_array_header_t *parts = apr_array_make(p, data->optional->subrequests->nelts + 1, sizeof(const char*));
+	const acc_subrequest *sub;
+	int i;
+
+	for (i = 0; i < data->optional->subrequests->nelts; i++)
+	{
+		sub = &APR_ARRAY_IDX(data->optional->subrequests, i, acc_subrequest);
+
+		APR_ARRAY_PUSH(parts, const char*) = apr_psprintf(
+			p,
+			"%" APR_INT64_T_FMT ":%" APR_INT64_T_FMT ":%d:%s",
+			sub->time,
+			sub->cpu,
+			sub->status,
+			sub->uri
+		);
+	}
+
+	if (data->optional->subrequests_dropped)
+		APR_ARRAY_PUSH(parts, const char*) = apr_psprintf(p, "+%d", data->optional->subrequests_dropped);
+
+	return apr_array_pstrcat(p, parts, ' ');
+} // }}}
+
+
+/* Watch for the first output
+ *
+ * The output phase starts with the first brigade that reaches the
+ * filters, and so does the response of a backend. After that the filter
+ * is of no further use.
+ */
+static ap_filter_rec_t *first_output_filter_handle;
+
+static apr_status_t first_output_filter(ap_filter_t *f, apr_bucket_brigade *bb){ // {{{
+	acc_data *data;
+	struct timeval now;
+
+	if (APR_BRIGADE_EMPTY(bb))
+		return ap_pass_brigade(f->next, bb);
+
+	phase_mark(f->r, ACC_PHASE_OUTPUT);
+
+	if ((data = request_data(f->r)) != NULL && data->optional->backend && data->optional->backend->active)
+	{
+		if (!data->optional->backend->first)
+		{
+			wall_clock(f->r, 0, &now);
+			data->optional->backend->ttfb = elapsed(&(data->optional->backend->start), &now);
+			data->optional->backend->first = 1;
+		}
+
+		/* Before the headers are sent */
+		backend_take_header(f->r, data->optional->backend);
+	}
+
+	ap_remove_output_filter(f);
+
+	return ap_pass_brigade(f->next, bb);
+} // }}}
+
+
+/* Count the bytes of a brigade
+ *
+ * Only the lengths of the buckets are added up, their data isn't read.
+ * Buckets of unknown length (e.g. unread pipes) don't count, but by the
+ * time a response gets through the protocol filters, the content length
+ * or chunk filter has read them.
+ */
+static apr_int64_t brigade_bytes(apr_bucket_brigade *bb){ // {{{
+	apr_int64_t bytes = 0;
+	apr_bucket *e;
+
+	for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb); e = APR_BUCKET_NEXT(e))
+	{
+		if (e->length != (apr_size_t) -1)
+			bytes += e->length;
+	}
+
+	return bytes;
+} // }}}
+
+
+/* Count the request body, after the protocol filters took off any chunk
+ * encoding */
+static ap_filter_rec_t *bytes_in_filter_handle;
+
+static apr_status_t bytes_in_filter(ap_filter_t *f, apr_bucket_brigade *bb, ap_input_mode_t mode, apr_read_type_e block, apr_off_t readbytes){ // {{{
+	acc_data *data = f->ctx;
+	apr_status_t rv;
+
+	if ((rv = ap_get_brigade(f->next, bb, mode, block, readbytes)) != APR_SUCCESS)
+		return rv;
+
+	/* Speculative reads will be read again */
+	if (data && mode != AP_MODE_SPECULATIVE)
+		data->optional->bytes_in += brigade_bytes(bb);
+
+	return APR_SUCCESS;
+} // }}}
+
+
+/* Count the response as it goes out, headers and chunk encoding included,
+ * and the time of its first byte
+ *
+ * It's a protocol filter, so internal redirects inherit it with the rest
+ * of r->proto_output_filters, and it's only added once per chain.
+ */
+static ap_filter_rec_t *bytes_out_filter_handle;
+
+static apr_status_t bytes_out_filter(ap_filter_t *f, apr_bucket_brigade *bb){ // {{{
+	acc_data *data = f->ctx;
+	struct timeval now;
+	apr_int64_t bytes;
+
+	if (data && (bytes = brigade_bytes(bb)) > 0)
+	{
+		if (data->optional->ttfb == -1)
+		{
+			wall_clock(f->r, 0, &now);
+			data->optional->ttfb = elapsed(&(data->begin_time), &now);
+		}
+
+		data->optional->bytes_out += bytes;
+	}
+
+	return ap_pass_brigade(f->next, bb);
+} // }}}
+
+
+static void module_accounting_insert_filter(request_rec *r){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	acc_data *data;
+
+	/* Subrequests only for the backends they proxy to */
+	if ((conf->phases && r->main == NULL) || conf->backend)
+		ap_add_output_filter_handle(first_output_filter_handle, NULL, r, r->connection);
+
+	/* Subrequests pass their output and read their input through the
+	 * main request */
+	if (conf->bytes && r->main == NULL && (data = request_data(r)) != NULL && data->weight)
+	{
+		ap_filter_t *f;
+
+		data_optional(data);
+		ap_add_input_filter_handle(bytes_in_filter_handle, data, r, r->connection);
+
+		for (f = r->proto_output_filters; f; f = f->next)
+		{
+			if (f->frec == bytes_out_filter_handle)
+				break;
+		}
+
+		if (f == NULL)
+			ap_add_output_filter_handle(bytes_out_filter_handle, data, r, r->connection);
+	}
+} // }}}
+
+
+/* Mark the start of the handler, and remember requests that ran a handler
+ * which spawns children
+ *
+ * Runs first for every handler invocation, including subrequests (e.g.
+ * mod_include's exec cgi), and never handles the request itself.
+ */
+static int module_accounting_handler(request_rec *r){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	acc_data *data;
+	int i;
+
+	if (conf->phases)
+		phase_mark(r, ACC_PHASE_HANDLER);
+
+	if (conf->reap != ACC_REAP_HANDLER || r->handler == NULL)
+		return DECLINED;
+
+	for (i = 0; i < conf->reap_handlers->nelts; i++)
+	{
+		if (!strcmp(r->handler, APR_ARRAY_IDX(conf->reap_handlers, i, const char*)))
+		{
+			if ((data = request_data(r)) != NULL)
+			{
+				data->reap_any = 1;
+
+				if (data->weight)
+					child_usage_begin(r, data);
+			}
+			break;
+		}
+	}
+
+	return DECLINED;
+} // }}}
+
+
+/* Reap the children of this request
+ *
+ * Only children that have already terminated are reaped (WNOHANG). The
+ * registered ones are waited for by PID; any child is only waited for
+ * when configured so or when a spawning handler ran for the request.
+ */
+static void reap_children(const request_rec *r, const acc_data *data){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	int i;
+
+	if (data->children)
+	{
+		for (i = 0; i < data->children->nelts; i++)
+			wait4(APR_ARRAY_IDX(data->children, i, pid_t), NULL, WNOHANG, NULL);
+	}
+
+	if (conf->reap == ACC_REAP_ALWAYS || data->reap_any)
+		wait4(-1, NULL, WNOHANG, NULL);
+} // }}}
+
+
+/* Tick of the budget window of a server */
+static apr_uint32_t budget_tick(const acc_server_conf *conf, apr_time_t now){ // {{{
+	return (apr_uint32_t) ((now - shm_header->h.created) / (conf->budget_window / ACC_BUDGET_BUCKETS));
+} // }}}
+
+
+/* Add the CPU time of a request to the current bucket */
+static void budget_add(const request_rec *r, const acc_result *res, int weight){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	acc_budget_bucket *bucket;
+	apr_uint32_t tick, seen;
+	apr_int64_t cpu;
+
+	/* A request whose own CPU time isn't known is left out */
+	if (!conf->budget || shm_header == NULL || !(res->groups & ACC_GROUP_BASE))
+		return;
+
+	cpu = res->value[ACC_M_UTIME] + res->value[ACC_M_STIME] +
+		res->value[ACC_M_CUTIME] + res->value[ACC_M_CSTIME];
+
+	if (cpu <= 0)
+		return;
+
+	tick = budget_tick(conf, apr_time_now());
+	bucket = &(SHM_SLOTS()[conf->slot].counters.budget[tick % ACC_BUDGET_BUCKETS]);
+
+	/* Whoever moves the bucket on to this tick clears it */
+	if ((seen = apr_atomic_read32(&(bucket->tick))) != tick &&
+		apr_atomic_cas32(&(bucket->tick), tick, seen) == seen)
+	{
+		ACC_ATOMIC_STORE(&(bucket->cpu), 0);
+	}
+
+	ACC_ATOMIC_ADD(&(bucket->cpu), (apr_uint64_t) (cpu * weight));
+} // }}}
+
+
+/* CPU time of a server in the current window */
+static apr_uint64_t budget_used(const acc_server_conf *conf, apr_uint32_t tick){ // {{{
+	const acc_budget_bucket *buckets = SHM_SLOTS()[conf->slot].counters.budget;
+	apr_uint64_t used = 0;
+	int i;
+
+	for (i = 0; i < ACC_BUDGET_BUCKETS; i++)
+	{
+		if (tick - buckets[i].tick < ACC_BUDGET_BUCKETS)
+			used += ACC_ATOMIC_LOAD(&(buckets[i].cpu));
+	}
+
+	return used;
+} // }}}
+
+
+/* Refuse or delay requests of servers over their CPU budget
+ *
+ * Runs right after the request was read, when its server is known but
+ * before anything else had to be done for it.
+ */
+static int module_accounting_budget(request_rec *r){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	apr_uint64_t used;
+
+	if (!conf->budget || shm_header == NULL || r->prev || r->main)
+		return DECLINED;
+
+	used = budget_used(conf, budget_tick(conf, apr_time_now()));
+	if (used < (apr_uint64_t) conf->budget)
+		return DECLINED;
+
+	ap_log_rerror(
+		APLOG_MARK,
+		APLOG_INFO,
+		APR_SUCCESS,
+		r,
+		"CPU budget of %s exceeded: %" APR_UINT64_T_FMT " of %" APR_INT64_T_FMT " microseconds",
+		conf->name,
+		used,
+		conf->budget
+	);
+
+	if (conf->budget_action == ACC_BUDGET_DELAY)
+	{
+		apr_sleep(conf->budget_delay);
+		return DECLINED;
+	}
+
+	/* Try again once the oldest bucket has dropped out */
+	apr_table_setn(
+		r->err_headers_out,
+		"Retry-After",
+		apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_sec(conf->budget_window / ACC_BUDGET_BUCKETS) + 1)
+	);
+
+	return conf->budget_action == ACC_BUDGET_LIMIT ? HTTP_TOO_MANY_REQUESTS : HTTP_SERVICE_UNAVAILABLE;
+} // }}}
+
+
+/* Bucket of a value
+ *
+ * The position of the highest bit selects the power of two, the bits
+ * below it the bucket within.
+ */
+static int bucket_index(apr_int64_t value){ // {{{
+	apr_uint64_t v = value > 0 ? (apr_uint64_t) value : 0;
+	int msb;
+
+	if (v < ACC_BUCKET_SUB)
+		return (int) v;
+
+#if defined(__GNUC__)
+	msb = 63 - __builtin_clzll(v);
+#else
+	for (msb = 0; v >> (msb + 1); msb++)
+		;
+#endif
+
+	if (msb > ACC_BUCKET_MAX_EXP)
+		return ACC_BUCKETS - 1;
+
+	return ACC_BUCKET_SUB * (msb - ACC_BUCKET_BITS + 1) +
+		(int) ((v >> (msb - ACC_BUCKET_BITS)) & (ACC_BUCKET_SUB - 1));
+} // }}}
+
+
+/* Highest value of a bucket */
+static apr_uint64_t bucket_value(int index){ // {{{
+	int shift;
+
+	if (index < ACC_BUCKET_SUB)
+		return index;
+
+	shift = index / ACC_BUCKET_SUB - 1;
+	return (((apr_uint64_t) (ACC_BUCKET_SUB + index % ACC_BUCKET_SUB + 1)) << shift) - 1;
+} // }}}
+
+
+/* Add a request to the histograms of what was measured for it, so one
+ * without a CPU time doesn't show up as 0 */
+static void histograms_add(acc_counters *counters, const acc_result *res, int weight){ // {{{
+	ACC_ATOMIC_ADD(
+		&(counters->histogram[ACC_HIST_TIME][bucket_index(res->value[ACC_M_TIME])]),
+		(apr_uint64_t) weight
+	);
+
+	if (MEASURED(res, ACC_M_UTIME))
+	{
+		ACC_ATOMIC_ADD(
+			&(counters->histogram[ACC_HIST_CPU][bucket_index(res->value[ACC_M_UTIME] + res->value[ACC_M_STIME])]),
+			(apr_uint64_t) weight
+		);
+	}
+
+	if (MEASURED(res, ACC_M_CUTIME))
+	{
+		ACC_ATOMIC_ADD(
+			&(counters->histogram[ACC_HIST_CHILD_CPU][bucket_index(res->value[ACC_M_CUTIME] + res->value[ACC_M_CSTIME])]),
+			(apr_uint64_t) weight
+		);
+	}
+} // }}}
+
+
+/* Add the results of a request to the counters of its server, and of
+ * its key */
+static void aggregate(const request_rec *r, const acc_result *res, int weight, apr_uint32_t key){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	acc_counters *counters;
+	int i;
+
+	if (!conf->aggregate || shm_header == NULL)
+		return;
+
+	counters = &(SHM_SLOTS()[conf->slot].counters);
+
+	ACC_ATOMIC_ADD(&(counters->requests), (apr_uint64_t) weight);
+
+	for (i = 0; i < ACC_METRICS; i++)
+	{
+		if (MEASURED(res, i))
+			ACC_ATOMIC_ADD(&(counters->value[i]), (apr_uint64_t) (res->value[i] * weight));
+	}
+
+	if (conf->histograms)
+		histograms_add(counters, res, weight);
+
+	/* And to every URI prefix of the server that matches */
+	if (conf->prefixes && r->uri)
+	{
+		const acc_prefix *prefixes = (const acc_prefix*) conf->prefixes->elts;
+		int j;
+
+		for (j = 0; j < conf->prefixes->nelts; j++)
+		{
+			if (strncmp(r->uri, prefixes[j].prefix, prefixes[j].len))
+				continue;
+
+			counters = &(SHM_SLOTS()[prefixes[j].slot].counters);
+
+			ACC_ATOMIC_ADD(&(counters->requests), (apr_uint64_t) weight);
+
+			for (i = 0; i < ACC_METRICS; i++)
+			{
+				if (MEASURED(res, i))
+					ACC_ATOMIC_ADD(&(counters->value[i]), (apr_uint64_t) (res->value[i] * weight));
+			}
+
+			if (conf->histograms)
+				histograms_add(counters, res, weight);
+		}
+	}
+
+	if (key)
+	{
+		counters = &(SHM_KEY_SLOTS()[key - 1].counters);
+
+		ACC_ATOMIC_ADD(&(counters->requests), (apr_uint64_t) weight);
+
+		for (i = 0; i < ACC_METRICS; i++)
+		{
+			if (MEASURED(res, i))
+				ACC_ATOMIC_ADD(&(counters->value[i]), (apr_uint64_t) (res->value[i] * weight));
+		}
+
+		if (conf->histograms)
+			histograms_add(counters, res, weight);
+	}
+} // }}}
+
+
+/* FNV-1a hash of a heavy hitter key */
+static apr_uint64_t hitter_hash(apr_uint32_t server, apr_uint32_t key_id, const char *key){ // {{{
+	apr_uint64_t hash = 14695981039346656037ULL;
+	int i;
+
+	for (i = 0; i < 4; i++, server >>= 8)
+	{
+		hash ^= server & 0xff;
+		hash *= 1099511628211ULL;
+	}
+
+	for (i = 0; i < 4; i++, key_id >>= 8)
+	{
+		hash ^= key_id & 0xff;
+		hash *= 1099511628211ULL;
+	}
+
+	for (; *key; key++)
+	{
+		hash ^= (unsigned char) *key;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+} // }}}
+
+
+/* Try to lock a set, without waiting long */
+static int hitter_lock(acc_hitter_set *set){ // {{{
+	int i;
+
+	for (i = 0; i < ACC_HITTER_SPIN; i++)
+	{
+		if (apr_atomic_cas32(&(set->l.w.lock), 1, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+} // }}}
+
+
+static void hitter_unlock(acc_hitter_set *set){ // {{{
+	apr_atomic_set32(&(set->l.w.lock), 0);
+} // }}}
+
+
+/* Add the CPU time of a request to the entry of its key */
+static void hitter_add(int table, apr_uint32_t server, apr_uint32_t key_id, const char *key, apr_uint64_t cpu, apr_uint64_t requests){ // {{{
+	apr_uint64_t hash = hitter_hash(server, key_id, key);
+	acc_hitter_set *set = SHM_HITTERS(table) + hash % shm_header->h.hitter_sets;
+	acc_hitter *entry, *least;
+	int i;
+
+	if (!hitter_lock(set))
+		return;
+
+	apr_atomic_inc32(&(set->l.w.seq));
+
+	for (least = entry = set->entries, i = 0; i < ACC_HITTER_WAYS; i++, entry++)
+	{
+		if (entry->hash == hash && entry->requests)
+			break;
+
+		if (entry->cpu < least->cpu)
+			least = entry;
+	}
+
+	/* A new key takes over the least busy entry, and its count */
+	if (i == ACC_HITTER_WAYS)
+	{
+		entry = least;
+		entry->hash = hash;
+		entry->error = entry->cpu;
+		entry->server = server;
+		entry->key_id = key_id;
+		apr_cpystrn(entry->key, key, ACC_HITTER_KEY);
+	}
+
+	entry->cpu += cpu;
+	entry->requests += requests;
+
+	apr_atomic_inc32(&(set->l.w.seq));
+	hitter_unlock(set);
+} // }}}
+
+
+/* Count the CPU time of a request for its URI and client
+ *
+ * URIs are kept by AccountingKey when the server has one, so the tenants
+ * of a server keep apart; else the key is 0, and only the server counts.
+ */
+static void heavy_hitters(const request_rec *r, const acc_result *res, int weight, apr_uint32_t key){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	apr_int64_t cpu;
+	const char *client;
+
+	/* A request whose own CPU time isn't known is left out */
+	if (shm_header == NULL || !shm_header->h.hitter_sets || !(res->groups & ACC_GROUP_BASE))
+		return;
+
+	cpu = res->value[ACC_M_UTIME] + res->value[ACC_M_STIME] +
+		res->value[ACC_M_CUTIME] + res->value[ACC_M_CSTIME];
+
+	/* Nothing to add, and no reason to take over an entry */
+	if (cpu <= 0)
+		return;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20111130, 0)
+	client = r->useragent_ip;
+#else
+	client = r->connection->remote_ip;
+#endif
+
+	if (r->uri)
+		hitter_add(ACC_HITTER_URI, conf->id, key, r->uri, (apr_uint64_t) (cpu * weight), weight);
+
+	if (client)
+		hitter_add(ACC_HITTER_CLIENT, 0, 0, client, (apr_uint64_t) (cpu * weight), weight);
+} // }}}
+
+
+/* Write out the buffered binary log records
+ *
+ * Called with the mutex held.
+ */
+static void binlog_flush(void){ // {{{
+	apr_status_t rv;
+
+	if (binlog.used == 0)
+		return;
+
+	if ((rv = apr_file_write_full(binlog.file, binlog.buf, binlog.used, NULL)) != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			binlog.server,
+			"Failed to write %" APR_SIZE_T_FMT " bytes to the accounting log",
+			binlog.used
+		);
+	}
+
+	binlog.used = 0;
+	binlog.flushed = apr_time_now();
+} // }}}
+
+
+/* Append a record to the buffer, flushing it when needed
+ *
+ * Called with the mutex held.
+ */
+static void binlog_append(const void *record, apr_size_t size, apr_time_t now){ // {{{
+	if (binlog.used + size > binlog.size)
+		binlog_flush();
+
+	/* Doesn't fit at all (a very long server name), write it on its own */
+	if (size > binlog.size)
+	{
+		apr_file_write_full(binlog.file, record, size, NULL);
+		return;
+	}
+
+	memcpy(binlog.buf + binlog.used, record, size);
+	binlog.used += size;
+
+	if (binlog.used == binlog.size || now - binlog.flushed >= binlog.interval)
+		binlog_flush();
+} // }}}
+
+
+static void binlog_lock(void){ // {{{
+#if APR_HAS_THREADS
+	if (binlog.mutex)
+		apr_thread_mutex_lock(binlog.mutex);
+#endif
+} // }}}
+
+
+static void binlog_unlock(void){ // {{{
+#if APR_HAS_THREADS
+	if (binlog.mutex)
+		apr_thread_mutex_unlock(binlog.mutex);
+#endif
+} // }}}
+
+
+static void binlog_header(acc_binlog_header *header, int type, apr_size_t size){ // {{{
+	header->magic = ACC_BINLOG_MAGIC;
+	header->version = ACC_BINLOG_VERSION;
+	header->type = type;
+	header->size = size;
+} // }}}
+
+
+/* Log the results of a request to the binary log */
+static void binlog_request(const request_rec *last, const acc_result *res){ // {{{
+	const acc_server_conf *conf = ap_get_module_config(last->server->module_config, &accounting_module);
+	char record[ACC_BINLOG_ALIGN(sizeof(acc_binlog_request) + ACC_METRICS * sizeof(apr_int64_t))];
+	acc_binlog_request *req = (acc_binlog_request*) record;
+	apr_time_t now;
+
+	if (binlog.buf == NULL)
+		return;
+
+	/* The end time may come from a monotonic clock */
+	now = apr_time_now();
+
+	memset(record, 0, sizeof(record));
+	binlog_header(&(req->header), ACC_BINLOG_REQUEST, sizeof(record));
+	req->timestamp = now;
+	req->server = conf->id;
+	req->status = last->status;
+	req->values = ACC_METRICS;
+	req->bytes = last->bytes_sent;
+	memcpy(req + 1, res->value, ACC_METRICS * sizeof(apr_int64_t));
+
+	binlog_lock();
+	binlog_append(record, sizeof(record), now);
+	binlog_unlock();
+} // }}}
+
+
+/* Flush what's left when the child exits */
+static apr_status_t binlog_cleanup(void *dummy){ // {{{
+	binlog_lock();
+	binlog_flush();
+	binlog.buf = NULL;
+	binlog_unlock();
+
+	return APR_SUCCESS;
+} // }}}
+
+
+#if APR_HAS_THREADS
+/* Flush the buffer once it's older than the interval, between requests */
+static void * APR_THREAD_FUNC binlog_thread(apr_thread_t *thread, void *dummy){ // {{{
+	apr_thread_mutex_lock(binlog.mutex);
+
+	while (!binlog.stop)
+	{
+		apr_time_t wait = binlog.flushed + binlog.interval - apr_time_now();
+
+		apr_thread_cond_timedwait(binlog.cond, binlog.mutex, wait > 0 ? wait : binlog.interval);
+
+		if (!binlog.stop && apr_time_now() - binlog.flushed >= binlog.interval)
+			binlog_flush();
+	}
+
+	apr_thread_mutex_unlock(binlog.mutex);
+	apr_thread_exit(thread, APR_SUCCESS);
+
+	return NULL;
+} // }}}
+
+
+/* Stop the thread before binlog_cleanup() */
+static apr_status_t binlog_thread_cleanup(void *dummy){ // {{{
+	apr_status_t rv;
+
+	apr_thread_mutex_lock(binlog.mutex);
+	binlog.stop = 1;
+	apr_thread_cond_signal(binlog.cond);
+	apr_thread_mutex_unlock(binlog.mutex);
+
+	apr_thread_join(&rv, binlog.thread);
+
+	return APR_SUCCESS;
+} // }}}
+#endif
+
+
+/* Set up the buffer of a child
+ *
+ * The log itself was opened by the parent. The buffer starts with the
+ * names of the metrics and of all servers, which decoders need to make
+ * sense of the request records.
+ */
+static void binlog_child_init(apr_pool_t *p, server_rec *s){ // {{{
+	const acc_server_conf *main_conf = ap_get_module_config(s->module_config, &accounting_module);
+	acc_binlog_metrics *names;
+	apr_size_t length, size;
+	server_rec *vs;
+	char *c;
+	int i;
+#if APR_HAS_THREADS
+	apr_status_t rv;
+#endif
+
+	if (binlog.file == NULL)
+		return;
+
+	binlog.server = s;
+	binlog.size = main_conf->binlog_buffer;
+	binlog.interval = main_conf->binlog_interval;
+	binlog.flushed = apr_time_now();
+	binlog.used = 0;
+	binlog.buf = apr_palloc(p, binlog.size);
+
+#if APR_HAS_THREADS
+	binlog.mutex = NULL;
+	apr_thread_mutex_create(&(binlog.mutex), APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+
+	/* The names of the metrics */
+	for (length = 0, i = 0; i < ACC_METRICS; i++)
+		length += strlen(metrics[i].name) + 1;
+
+	size = ACC_BINLOG_ALIGN(sizeof(acc_binlog_metrics) + length);
+	names = apr_pcalloc(p, size);
+	binlog_header(&(names->header), ACC_BINLOG_METRICS, size);
+	names->count = ACC_METRICS;
+	names->length = length;
+
+	for (c = (char*) (names + 1), i = 0; i < ACC_METRICS; i++)
+		c = apr_cpystrn(c, metrics[i].name, strlen(metrics[i].name) + 1) + 1;
+
+	binlog_append(names, size, binlog.flushed);
+
+	/* The names of the servers */
+	for (vs = s; vs; vs = vs->next)
+	{
+		const acc_server_conf *conf = ap_get_module_config(vs->module_config, &accounting_module);
+		acc_binlog_server *server;
+
+		length = strlen(conf->name) + 1;
+		size = ACC_BINLOG_ALIGN(sizeof(acc_binlog_server) + length);
+		server = apr_pcalloc(p, size);
+		binlog_header(&(server->header), ACC_BINLOG_SERVER, size);
+		server->id = conf->id;
+		server->length = length;
+		memcpy(server + 1, conf->name, length);
+
+		binlog_append(server, size, binlog.flushed);
+	}
+
+	apr_pool_cleanup_register(p, NULL, binlog_cleanup, apr_pool_cleanup_null);
+
+#if APR_HAS_THREADS
+	/* With an interval of 0 every record is written right away */
+	binlog.stop = 0;
+	if (binlog.mutex == NULL || !binlog.interval)
+		return;
+
+	if ((rv = apr_thread_cond_create(&(binlog.cond), p)) != APR_SUCCESS ||
+		(rv = apr_thread_create(&(binlog.thread), NULL, binlog_thread, NULL, p)) != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			s,
+			"Failed to start the accounting log flush thread"
+		);
+		return;
+	}
+
+	apr_pool_pre_cleanup_register(p, NULL, binlog_thread_cleanup);
+#endif
+} // }}}
+
+
+/* Add a request to the lifetime of the child */
+static void lifetime_add(const acc_result *res, int weight){ // {{{
+	if (!lifetime.enabled)
+		return;
+
+	ACC_ATOMIC_ADD(&(lifetime.requests), (apr_uint64_t) weight);
+
+	if (MEASURED(res, ACC_M_UTIME))
+	{
+		ACC_ATOMIC_ADD(&(lifetime.utime), (apr_uint64_t) (res->value[ACC_M_UTIME] * weight));
+		ACC_ATOMIC_ADD(&(lifetime.stime), (apr_uint64_t) (res->value[ACC_M_STIME] * weight));
+	}
+
+	if (MEASURED(res, ACC_M_CUTIME))
+	{
+		ACC_ATOMIC_ADD(&(lifetime.cutime), (apr_uint64_t) (res->value[ACC_M_CUTIME] * weight));
+		ACC_ATOMIC_ADD(&(lifetime.cstime), (apr_uint64_t) (res->value[ACC_M_CSTIME] * weight));
+	}
+} // }}}
+
+
+/* Microseconds of a struct timeval */
+static apr_int64_t timeval_usec(const struct timeval *tv){ // {{{
+	return (apr_int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+} // }}}
+
+
+/* Report the lifetime of the child when it exits
+ *
+ * Registered after binlog_cleanup(), so it runs before the buffer is
+ * flushed for the last time.
+ */
+static apr_status_t lifetime_cleanup(void *dummy){ // {{{
+	struct rusage self, children;
+	acc_binlog_child record;
+	apr_time_t now = apr_time_now();
+
+	if (getrusage(RUSAGE_SELF, &self) == -1 || getrusage(RUSAGE_CHILDREN, &children) == -1)
+		return APR_SUCCESS;
+
+	memset(&record, 0, sizeof(record));
+	record.timestamp = now;
+	record.started = lifetime.started;
+	record.pid = getpid();
+	record.requests = lifetime.requests;
+	record.utime = timeval_usec(&(self.ru_utime));
+	record.stime = timeval_usec(&(self.ru_stime));
+	record.cutime = timeval_usec(&(children.ru_utime));
+	record.cstime = timeval_usec(&(children.ru_stime));
+	record.request_utime = lifetime.utime;
+	record.request_stime = lifetime.stime;
+	record.request_cutime = lifetime.cutime;
+	record.request_cstime = lifetime.cstime;
+	record.maxrss = self.ru_maxrss;
+
+	if (shm_header)
+	{
+		apr_uint64_t *totals = shm_header->h.lifetimes;
+
+		ACC_ATOMIC_ADD(&(totals[ACC_LIFETIME_EXITED]), 1);
+		ACC_ATOMIC_ADD(&(totals[ACC_LIFETIME_CPU]), (apr_uint64_t) (record.utime + record.stime));
+		ACC_ATOMIC_ADD(&(totals[ACC_LIFETIME_REQUEST_CPU]), (apr_uint64_t) (record.request_utime + record.request_stime));
+		ACC_ATOMIC_ADD(&(totals[ACC_LIFETIME_CHILDREN_CPU]), (apr_uint64_t) (record.cutime + record.cstime));
+		ACC_ATOMIC_ADD(&(totals[ACC_LIFETIME_REQUEST_CHILDREN_CPU]), (apr_uint64_t) (record.request_cutime + record.request_cstime));
+	}
+
+	if (binlog.buf)
+	{
+		binlog_header(&(record.header), ACC_BINLOG_CHILD, sizeof(record));
+
+		binlog_lock();
+		binlog_append(&record, sizeof(record), now);
+		binlog_unlock();
+	}
+
+	return APR_SUCCESS;
+} // }}}
+
+
+/* Start the lifetime of a child, when there's somewhere to report it */
+static void lifetime_child_init(apr_pool_t *p, server_rec *s){ // {{{
+	memset(&lifetime, 0, sizeof(lifetime));
+
+	if (binlog.buf == NULL && shm_header == NULL)
+		return;
+
+	lifetime.enabled = 1;
+	lifetime.started = apr_time_now();
+
+	apr_pool_cleanup_register(p, NULL, lifetime_cleanup, apr_pool_cleanup_null);
+} // }}}
+
+
+/* Stop accounting
+ *
+ * Here we will request the resource information at the end of the period
+ * we want to account. Using the reference (begin) values we retrieved in
+ * the module_acccounting_start() function we can now determine the resource
+ * usage of this request.
+ */
+static int module_accounting_stop(request_rec *r) { // {{{
+	/* printf("Module accounting stop\n"); */
+	struct timeval end_time;
+	struct rusage  end_own_usage;
+	struct rusage  end_child_usage;
+	acc_data *data;
+	acc_result *res;
+	const acc_server_conf *conf = ap_get_module_config(r->server->module_config, &accounting_module);
+	const acc_dir_conf *dconf;
+	int same_thread;
+	
+	/* Resolve the internal redirect request */
+	request_rec *initial;
+	request_rec *last;
+	
+	/* Get the reference (begin) data, which is missing when accounting
+	 * is switched off for the server */
+	if ((data = request_data(r)) == NULL)
+		return DECLINED;
+
+	/* The first request was found by module_accounting_start(), the last
+	 * one is only known now */
+	initial = data->initial;
+	last = last_request(initial);
+
+	/* Or for where the request ended up */
+	dconf = ap_get_module_config(last->per_dir_config, &accounting_module);
+	if (!dconf->enabled)
+		return DECLINED;
+
+	/* Not sampled, so only slow requests are reported */
+	if (!data->weight)
+	{
+		apr_int64_t time = apr_time_now() - initial->request_time;
+
+		if (!conf->slow_threshold || time < conf->slow_threshold)
+			return DECLINED;
+
+		res = apr_pcalloc(initial->pool, sizeof(acc_result));
+		res->selected = dconf->selected;
+		res->groups = ACC_GROUP_TIME;
+		res->value[ACC_M_TIME] = time;
+		data->result = res;
+
+		if (conf->notes)
+			set_notes(last, res);
+
+		apr_table_setn(last->subprocess_env, ACC_SAMPLE_ENV, "slow");
+		binlog_request(last, res);
+
+		return DECLINED;
+	}
+	
+	/* Request resource information at this point */
+
+	/* Wait for the children of this request, so they're included in the
+	 * RUSAGE_CHILDREN values */
+	if (data->begin_child)
+		reap_children(r, data);
+
+	/* What's the time? */
+	if (wall_clock(r, 0, &(end_time)) == -1)
+	{
+		/* ERROR */
+		ACC_LOG_REQ_ERROR("Request for (end) time failed");
+	}
+
+	/* Get the accumelated resource usage of this process */
+	if (own_usage(r, &(end_own_usage)) == -1)
+	{
+		/* ERROR */
+		ACC_LOG_REQ_ERROR("Request for (end) resource usage failed");
+	}
+
+	/* Get the accumelated resource usage for childeren of this process */
+	if (data->begin_child && getrusage(RUSAGE_CHILDREN, &(end_child_usage)) == -1)
+	{
+		/* ERROR */
+		ACC_LOG_REQ_ERROR("Request for children's (end) resource usage failed");
+	}
+
+	/* Per thread values only compare on the thread that took them */
+	same_thread = thread_same(data->thread, thread_self());
+	if (!same_thread && conf->cpu_source == ACC_CPU_THREAD)
+		report_anomaly(last, ACC_ANOMALY_THREAD, 0, 0);
+
+	/* Which are the begin values of the next request on the connection */
+	if (conf->conn_snapshot)
+		conn_snapshot_keep(r, conf, data, &end_own_usage, data->begin_child ? &end_child_usage : NULL);
+
+	/* Debug */ // {{{
+	if (ACC_TRACING(r))
+	{
+		ACC_LOG_DEBUG_TIME(
+			"accounting_stop:data->begin_time",
+			data->begin_time
+		);
+		ACC_LOG_DEBUG_TIME(
+			"accounting_stop:data->begin_own.utime",
+			data->begin_own.utime
+		);
+		ACC_LOG_DEBUG_TIME(
+			"accounting_stop:data->begin_own.stime",
+			data->begin_own.stime
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"accounting_stop:data->begin_own.inblock",
+			data->begin_own.inblock
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"accounting_stop:data->begin_own.oublock",
+			data->begin_own.oublock
+		);
+
+		ACC_LOG_DEBUG_TIME(
+			"accounting_stop:end_time",
+			end_time
+		);
+		ACC_LOG_DEBUG_TIME(
+			"accounting_stop:end_own_usage.ru_utime",
+			end_own_usage.ru_utime
+		);
+		ACC_LOG_DEBUG_TIME(
+			"accounting_stop:end_own_usage.ru_stime",
+			end_own_usage.ru_stime
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"accounting_stop:end_own_usage.ru_inblock",
+			end_own_usage.ru_inblock
+		);
+		ACC_LOG_DEBUG_BLOCKS(
+			"accounting_stop:end_own_usage.ru_oublock",
+			end_own_usage.ru_oublock
+		);
+
+		if (data->begin_child)
+		{
+			ACC_LOG_DEBUG_TIME(
+				"accounting_stop:data->begin_child->utime",
+				data->begin_child->utime
+			);
+			ACC_LOG_DEBUG_TIME(
+				"accounting_stop:data->begin_child->stime",
+				data->begin_child->stime
+			);
+			ACC_LOG_DEBUG_BLOCKS(
+				"accounting_stop:data->begin_child->inblock",
+				data->begin_child->inblock
+			);
+			ACC_LOG_DEBUG_BLOCKS(
+				"accounting_stop:data->begin_child->oublock",
+				data->begin_child->oublock
+			);
+
+			ACC_LOG_DEBUG_TIME(
+				"accounting_stop:end_child_usage.ru_utime",
+				end_child_usage.ru_utime
+			);
+			ACC_LOG_DEBUG_TIME(
+				"accounting_stop:end_child_usage.ru_stime",
+				end_child_usage.ru_stime
+			);
+			ACC_LOG_DEBUG_BLOCKS(
+				"accounting_stop:end_child_usage.ru_inblock",
+				end_child_usage.ru_inblock
+			);
+			ACC_LOG_DEBUG_BLOCKS(
+				"accounting_stop:end_child_usage.ru_oublock",
+				end_child_usage.ru_oublock
+			);
+		}
+	} // }}}
+	
+	/* Calculate the differences between start and stop, the results
+	 * are only allocated for the requests that are reported */
+	res = apr_pcalloc(initial->pool, sizeof(acc_result));
+	res->selected = dconf->selected;
+	res->groups = ACC_GROUP_TIME;
+
+	/* The time difference between start and stop */
+	res->value[ACC_M_TIME] = time_difference(
+		last,
+		&(data->begin_time),
+		&(end_time)
+	);
+
+	/* The usage of another thread is left out instead */
+	if (same_thread || conf->cpu_source != ACC_CPU_THREAD)
+	{
+		res->groups |= ACC_GROUP_BASE;
+
+		/* The accumulated user time */
+		res->value[ACC_M_UTIME] = time_difference(
+			last,
+			&(data->begin_own.utime),
+			&(end_own_usage.ru_utime)
+		);
+
+		/* The accumulated system time */
+		res->value[ACC_M_STIME] = time_difference(
+			last,
+			&(data->begin_own.stime),
+			&(end_own_usage.ru_stime)
+		);
+
+		/* The rest only getrusage() knows */
+		if (!conf->lean)
+		{
+			/* The accumulated inblocks */
+			res->value[ACC_M_INBLOCK] = block_difference(
+				last,
+				data->begin_own.inblock,
+				end_own_usage.ru_inblock
+			);
+
+			/* The accumulated oublocks */
+			res->value[ACC_M_OUBLOCK] = block_difference(
+				last,
+				data->begin_own.oublock,
+				end_own_usage.ru_oublock
+			);
+
+			/* The page faults, and how much the largest resident set grew */
+			res->value[ACC_M_MINFLT] = block_difference(
+				last,
+				data->begin_own.minflt,
+				end_own_usage.ru_minflt
+			);
+
+			res->value[ACC_M_MAJFLT] = block_difference(
+				last,
+				data->begin_own.majflt,
+				end_own_usage.ru_majflt
+			);
+
+			res->value[ACC_M_MAXRSS_DELTA] = end_own_usage.ru_maxrss > data->begin_own.maxrss ?
+				end_own_usage.ru_maxrss - data->begin_own.maxrss : 0;
+
+			/* The voluntary (waiting for I/O or a lock) and involuntary (the
+			 * time slice ran out) context switches */
+			res->value[ACC_M_NVCSW] = block_difference(
+				last,
+				data->begin_own.nvcsw,
+				end_own_usage.ru_nvcsw
+			);
+
+			res->value[ACC_M_NIVCSW] = block_difference(
+				last,
+				data->begin_own.nivcsw,
+				end_own_usage.ru_nivcsw
+			);
+
+			res->groups |= ACC_GROUP_RUSAGE;
+		}
+	}
+
+	/* And the same for the children */
+	if (data->begin_child)
+	{
+		/* The child accumulated user time */
+		res->value[ACC_M_CUTIME] = time_difference(
+			last,
+			&(data->begin_child->utime),
+			&(end_child_usage.ru_utime)
+		);
+
+		/* The child accumulated system time */
+		res->value[ACC_M_CSTIME] = time_difference(
+			last,
+			&(data->begin_child->stime),
+			&(end_child_usage.ru_stime)
+		);
+
+		/* The child accumulated inblocks */
+		res->value[ACC_M_CINBLOCK] = block_difference(
+			last,
+			data->begin_child->inblock,
+			end_child_usage.ru_inblock
+		);
+
+		/* The child accumulated oublocks */
+		res->value[ACC_M_COUBLOCK] = block_difference(
+			last,
+			data->begin_child->oublock,
+			end_child_usage.ru_oublock
+		);
+
+		res->value[ACC_M_CMINFLT] = block_difference(
+			last,
+			data->begin_child->minflt,
+			end_child_usage.ru_minflt
+		);
+
+		res->value[ACC_M_CMAJFLT] = block_difference(
+			last,
+			data->begin_child->majflt,
+			end_child_usage.ru_majflt
+		);
+
+		res->value[ACC_M_CNVCSW] = block_difference(
+			last,
+			data->begin_child->nvcsw,
+			end_child_usage.ru_nvcsw
+		);
+
+		res->value[ACC_M_CNIVCSW] = block_difference(
+			last,
+			data->begin_child->nivcsw,
+			end_child_usage.ru_nivcsw
+		);
+
+		res->groups |= ACC_GROUP_CHILDREN;
+	}
+
+	/* The traffic of the request */
+	if (conf->bytes)
+	{
+		res->value[ACC_M_BYTES_IN] = data->optional->bytes_in;
+		res->value[ACC_M_BYTES_OUT] = data->optional->bytes_out;
+		res->value[ACC_M_TTFB] = data->optional->ttfb > 0 ? data->optional->ttfb : 0;
+		res->groups |= ACC_GROUP_BYTES;
+	}
+
+	/* The memory the request allocated */
+	if (conf->memory)
+	{
+		res->value[ACC_M_POOL_BYTES] = pool_bytes(initial, data);
+		res->groups |= ACC_GROUP_MEMORY;
+	}
+
+	/* The time spent in each phase, ending the last one */
+	if (data->optional->phases)
+	{
+		int i;
+
+		phase_switch(r, data->optional->phases, data->optional->phases->current);
+
+		for (i = 0; i < ACC_PHASES; i++)
+		{
+			res->value[ACC_M_PHASES + 2 * i] = data->optional->phases->time[i];
+			res->value[ACC_M_PHASES + 2 * i + 1] = data->optional->phases->cpu_time[i];
+		}
+
+		res->groups |= ACC_GROUP_PHASES;
+	}
+
+	/* The time spent on backends, if any */
+	if (data->optional->backend)
+	{
+		if (data->optional->backend->active)
+			data->optional->backend->time += elapsed(&(data->optional->backend->start), &end_time);
+
+		res->value[ACC_M_BACKEND_TIME] = data->optional->backend->time;
+		res->value[ACC_M_BACKEND_TTFB] = data->optional->backend->ttfb;
+		res->value[ACC_M_BACKEND_UTIME] = data->optional->backend->utime;
+		res->value[ACC_M_BACKEND_STIME] = data->optional->backend->stime;
+
+		res->groups |= ACC_GROUP_BACKEND;
+	}
+
+	/* The I/O of the thread */
+	if (data->optional->begin_io && same_thread)
+	{
+		acc_io end_io;
+		int i;
+
+		if (thread_io(r, &end_io) == 0)
+		{
+			for (i = 0; i < ACC_IO_KEYS; i++)
+			{
+				res->value[ACC_M_IO + i] = end_io.value[i] > data->optional->begin_io->value[i] ?
+					end_io.value[i] - data->optional->begin_io->value[i] : 0;
+			}
+
+			res->groups |= ACC_GROUP_IO;
+		}
+	}
+
+	/* Everything the cgroup used that this process didn't use itself,
+	 * which isn't known without the CPU time of the request itself */
+	if (data->optional->begin_cgroup && (res->groups & ACC_GROUP_BASE))
+	{
+		acc_cgroup_usage end_cgroup;
+
+		if (cgroup_usage(&end_cgroup) == 0)
+		{
+			apr_int64_t user = end_cgroup.user - data->optional->begin_cgroup->user - res->value[ACC_M_UTIME];
+			apr_int64_t system = end_cgroup.system - data->optional->begin_cgroup->system - res->value[ACC_M_STIME];
+
+			/* The split in user and system time is an estimate of
+			 * both sources, which needn't agree exactly */
+			res->value[ACC_M_CGROUP_CUTIME] = user > 0 ? user : 0;
+			res->value[ACC_M_CGROUP_CSTIME] = system > 0 ? system : 0;
+			res->value[ACC_M_CGROUP_READ_BYTES] = end_cgroup.rbytes - data->optional->begin_cgroup->rbytes;
+			res->value[ACC_M_CGROUP_WRITE_BYTES] = end_cgroup.wbytes - data->optional->begin_cgroup->wbytes;
+			res->value[ACC_M_CGROUP_MEMORY_PEAK] = cgroup_peak();
+
+			res->groups |= ACC_GROUP_CGROUP;
+		}
+	}
+
+	/* The subrequests that ended so far */
+	if (data->optional->subrequests)
+		data->optional->subrequests_summary = subrequest_summary(initial->pool, data);
+
+	/* The results are available to %{...}Z and acc_get_value() now */
+	data->result = res;
+
+	/* Only fill the notes table when somebody asked for it */
+	if (conf->notes)
+	{
+		set_notes(last, res);
+
+		if (data->optional->subrequests_summary)
+			apr_table_setn(last->notes, "ACC_subrequests", data->optional->subrequests_summary);
+	}
+
+	if (conf->sample_rate > 1)
+		apr_table_setn(last->subprocess_env, ACC_SAMPLE_ENV, "sampled");
+
+	/* Add to the totals of the server */
+	aggregate(r, res, data->weight, data->key);
+	lifetime_add(res, data->weight);
+	budget_add(r, res, data->weight);
+	heavy_hitters(last, res, data->weight, data->key);
+
+	/* And to the binary log */
+	binlog_request(last, res);
+
+	/* We're not a final handler */
+    return DECLINED;
+} // }}}
+
+
+/* Status output
+ *
+ * The accounting-status handler reports the aggregated counters of every
+ * server and URI prefix as plain text (default), JSON (?json) or in the
+ * Prometheus exposition format (?prometheus). The output is written to a
+ * brigade that's passed on whenever its buffer fills up, so the response
+ * is streamed instead of built in memory. The counters are read without
+ * any locking; a counter may be a request ahead of another, but writers are
+ * never held up.
+ */
+enum {
+	ACC_FORMAT_TEXT,
+	ACC_FORMAT_JSON,
+	ACC_FORMAT_PROMETHEUS
+};
+
+typedef struct {
+	const char         *server;	/* or NULL for a key */
+	const char         *prefix;
+	const char         *key;
+	const acc_counters *counters;
+	int                 histograms;
+} acc_status_row;
+
+/* Collect the counters to report, in server order */
+static apr_array_header_t *status_rows(request_rec *r){ // {{{
+	apr_array_header_t *rows = apr_array_make(r->pool, 16, sizeof(acc_status_row));
+	acc_status_row *row;
+	server_rec *vs;
+	int i;
+
+	for (vs = acc_servers; vs; vs = vs->next)
+	{
+		const acc_server_conf *conf = ap_get_module_config(vs->module_config, &accounting_module);
+		const char *name = conf->name;
+
+		if (!conf->aggregate)
+			continue;
+
+		row = apr_array_push(rows);
+		row->server = name;
+		row->prefix = NULL;
+		row->key = NULL;
+		row->counters = &(SHM_SLOTS()[conf->slot].counters);
+		row->histograms = conf->histograms;
+
+		if (conf->prefixes == NULL)
+			continue;
+
+		for (i = 0; i < conf->prefixes->nelts; i++)
+		{
+			const acc_prefix *prefix = &APR_ARRAY_IDX(conf->prefixes, i, acc_prefix);
+
+			row = apr_array_push(rows);
+			row->server = name;
+			row->prefix = prefix->prefix;
+			row->key = NULL;
+			row->counters = &(SHM_SLOTS()[prefix->slot].counters);
+			row->histograms = conf->histograms;
+		}
+	}
+
+	/* Then the keys seen so far, in table order */
+	for (i = 0; i < (int) shm_header->h.keys; i++)
+	{
+		const acc_key *key = &(SHM_KEYS()[i]);
+		const acc_counters *counters = &(SHM_KEY_SLOTS()[i].counters);
+
+		if (apr_atomic_read32((volatile apr_uint32_t*) &(key->state)) != ACC_KEY_READY ||
+			!ACC_ATOMIC_LOAD(&(counters->requests)))
+		{
+			continue;
+		}
+
+		row = apr_array_push(rows);
+		row->server = NULL;
+		row->prefix = NULL;
+		row->key = key->key;
+		row->counters = counters;
+		row->histograms = key_histograms;
+	}
+
+	return rows;
+} // }}}
+
+
+/* Percentiles of a histogram
+ *
+ * Reported as the highest value of the bucket the percentile falls in, so
+ * they're at most 12.5% too high. All zero without any requests.
+ */
+static void histogram_percentiles(const apr_uint64_t *buckets, apr_uint64_t *values){ // {{{
+	apr_uint64_t counts[ACC_BUCKETS];
+	apr_uint64_t total = 0, seen = 0;
+	int i, p = 0;
+
+	/* One consistent copy, requests come in all the time */
+	for (i = 0; i < ACC_BUCKETS; i++)
+		total += counts[i] = ACC_ATOMIC_LOAD(&(buckets[i]));
+
+	for (i = 0; i < ACC_BUCKETS && p < ACC_PERCENTILES; i++)
+	{
+		seen += counts[i];
+
+		/* seen / total >= percentile / 1000, without rounding */
+		while (total && p < ACC_PERCENTILES && seen * 1000 >= total * percentiles[p])
+			values[p++] = bucket_value(i);
+	}
+
+	while (p < ACC_PERCENTILES)
+		values[p++] = 0;
+} // }}}
+
+
+/* Sort heavy hitters by CPU time, the busiest first */
+static int hitter_compare(const void *a, const void *b){ // {{{
+	const acc_hitter *x = a;
+	const acc_hitter *y = b;
+
+	return x->cpu < y->cpu ? 1 : x->cpu > y->cpu ? -1 : 0;
+} // }}}
+
+
+/* Copy the entries of a set, without its lock
+ *
+ * A copy that was taken while hitter_add() changed the set is taken
+ * again. One that keeps changing is taken as it is after a few tries, so
+ * an entry may be torn: off by a request, or with the key of another
+ * entry; its key is always terminated.
+ */
+static void hitter_copy(const acc_hitter_set *set, acc_hitter *entries){ // {{{
+	acc_hitter_set *shared = (acc_hitter_set*) set;
+	apr_uint32_t seq;
+	int i;
+
+	for (i = 0; i < ACC_HITTER_COPIES; i++)
+	{
+		/* The adds are barriers, unlike a plain read */
+		seq = apr_atomic_add32(&(shared->l.w.seq), 0);
+		memcpy(entries, set->entries, sizeof(set->entries));
+
+		if (!(seq & 1) && apr_atomic_add32(&(shared->l.w.seq), 0) == seq)
+			return;
+	}
+
+	for (i = 0; i < ACC_HITTER_WAYS; i++)
+		entries[i].key[ACC_HITTER_KEY - 1] = '\0';
+} // }}}
+
+
+/* Copy the busiest entries of a table */
+static apr_array_header_t *hitter_top(request_rec *r, int table){ // {{{
+	apr_uint32_t sets = shm_header->h.hitter_sets;
+	apr_array_header_t *top = apr_array_make(r->pool, sets * ACC_HITTER_WAYS, sizeof(acc_hitter));
+	const acc_hitter_set *set = SHM_HITTERS(table);
+	acc_hitter entries[ACC_HITTER_WAYS];
+	apr_uint32_t i;
+	int j;
+
+	for (i = 0; i < sets; i++, set++)
+	{
+		hitter_copy(set, entries);
+
+		for (j = 0; j < ACC_HITTER_WAYS; j++)
+		{
+			if (entries[j].requests)
+				*(acc_hitter*) apr_array_push(top) = entries[j];
+		}
+	}
+
+	qsort(top->elts, top->nelts, sizeof(acc_hitter), hitter_compare);
+
+	if (top->nelts > ACC_HITTER_REPORT)
+		top->nelts = ACC_HITTER_REPORT;
+
+	return top;
+} // }}}
+
+
+/* Name of the server with an id */
+static const char *server_name(apr_uint32_t id){ // {{{
+	server_rec *vs;
+
+	for (vs = acc_servers; vs; vs = vs->next)
+	{
+		const acc_server_conf *conf = ap_get_module_config(vs->module_config, &accounting_module);
+
+		if (conf->id == id)
+			return conf->name;
+	}
+
+	return "-";
+} // }}}
+
+
+/* Length of the UTF-8 sequence at c, or 0 when it isn't a valid one
+ *
+ * Overlong forms, surrogates and code points past U+10FFFF are invalid.
+ * A sequence that's cut short by the end of the string is as well, as the
+ * terminating NUL is no continuation byte.
+ */
+static int utf8_length(const unsigned char *c){ // {{{
+	int n, i;
+	unsigned char min = 0x80, max = 0xbf;
+
+	if (*c < 0x80)
+		return 1;
+	else if (*c >= 0xc2 && *c <= 0xdf)
+		n = 2;
+	else if (*c >= 0xe0 && *c <= 0xef)
+	{
+		n = 3;
+		if (*c == 0xe0)
+			min = 0xa0;
+		else if (*c == 0xed)
+			max = 0x9f;
+	}
+	else if (*c >= 0xf0 && *c <= 0xf4)
+	{
+		n = 4;
+		if (*c == 0xf0)
+			min = 0x90;
+		else if (*c == 0xf4)
+			max = 0x8f;
+	}
+	else
+		return 0;
+
+	/* Only the first continuation byte has a narrower range */
+	for (i = 1; i < n; i++, min = 0x80, max = 0xbf)
+	{
+		if (c[i] < min || c[i] > max)
+			return 0;
+	}
+
+	return n;
+} // }}}
+
+
+/* Escape a string for use in JSON
+ *
+ * Backslashes, double quotes and control characters are escaped. JSON has
+ * to be valid UTF-8, which URIs and headers don't have to be, and a key
+ * may be cut in the middle of a sequence; a byte that isn't part of a
+ * valid sequence is escaped as \u00XX, as if it were Latin-1. Server
+ * names and prefixes rarely need any of it, so the string is returned as
+ * is when there's nothing to escape.
+ */
+static const char *json_escape(apr_pool_t *p, const char *str){ // {{{
+	const unsigned char *c;
+	char *escaped, *e;
+	int n = 1;
+
+	for (c = (const unsigned char*) str; *c; c += n)
+	{
+		if (*c == '"' || *c == '\\' || *c < 0x20 || (n = utf8_length(c)) == 0)
+			break;
+	}
+
+	if (!*c)
+		return str;
+
+	escaped = e = apr_palloc(p, strlen(str) * 6 + 1);
+	for (c = (const unsigned char*) str; *c; c += n)
+	{
+		n = 1;
+
+		if (*c == '"' || *c == '\\')
+		{
+			*e++ = '\\';
+			*e++ = *c;
+		}
+		else if (*c == '\n')
+		{
+			*e++ = '\\';
+			*e++ = 'n';
+		}
+		else if (*c < 0x20 || (n = utf8_length(c)) == 0)
+		{
+			apr_snprintf(e, 7, "\\u%04x", *c);
+			e += 6;
+			n = 1;
+		}
+		else
+		{
+			memcpy(e, c, n);
+			e += n;
+		}
+	}
+	*e = '\0';
+
+	return escaped;
+} // }}}
+
+
+/* Escape a Prometheus label value
+ *
+ * The exposition format only knows \\, \" and \n; everything else is
+ * taken as it is. The string is returned as is when there's nothing to
+ * escape.
+ */
+static const char *label_escape(apr_pool_t *p, const char *str){ // {{{
+	const char *c;
+	char *escaped, *e;
+
+	if (!str[strcspn(str, "\\\"\n")])
+		return str;
+
+	escaped = e = apr_palloc(p, strlen(str) * 2 + 1);
+	for (c = str; *c; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			*e++ = '\\';
+			*e++ = *c;
+		}
+		else if (*c == '\n')
+		{
+			*e++ = '\\';
+			*e++ = 'n';
+		}
+		else
+			*e++ = *c;
+	}
+	*e = '\0';
+
+	return escaped;
+} // }}}
+
+
+static void status_text_percentiles(request_rec *r, apr_bucket_brigade *bb, const apr_array_header_t *rows){ // {{{
+	apr_uint64_t values[ACC_PERCENTILES];
+	int i, j, k, header = 0;
+
+	for (i = 0; i < rows->nelts; i++)
+	{
+		const acc_status_row *row = &APR_ARRAY_IDX(rows, i, acc_status_row);
+
+		if (!row->histograms)
+			continue;
+
+		if (!header)
+		{
+			apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "# server prefix histogram");
+			for (k = 0; k < ACC_PERCENTILES; k++)
+				apr_brigade_printf(bb, ap_filter_flush, r->output_filters, " p%d", percentiles[k] % 10 ? percentiles[k] : percentiles[k] / 10);
+			apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n");
+			header = 1;
+		}
+
+		for (j = 0; j < ACC_HISTOGRAMS; j++)
+		{
+			histogram_percentiles(row->counters->histogram[j], values);
+
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				"%s%s %s %s",
+				row->server ? "" : "key:",
+				ap_escape_logitem(r->pool, row->server ? row->server : row->key),
+				row->prefix ? ap_escape_logitem(r->pool, row->prefix) : "-",
+				histogram_names[j]
+			);
+
+			for (k = 0; k < ACC_PERCENTILES; k++)
+				apr_brigade_printf(bb, ap_filter_flush, r->output_filters, " %" APR_UINT64_T_FMT, values[k]);
+
+			apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n");
+		}
+	}
+} // }}}
+
+
+static void status_text(request_rec *r, apr_bucket_brigade *bb, const apr_array_header_t *rows){ // {{{
+	int i, j;
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "# server prefix requests");
+	for (j = 0; j < ACC_METRICS; j++)
+	{
+		if (metrics[j].group & groups_enabled)
+			apr_brigade_printf(bb, ap_filter_flush, r->output_filters, " %s", metrics[j].name);
+	}
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n");
+
+	for (i = 0; i < rows->nelts; i++)
+	{
+		const acc_status_row *row = &APR_ARRAY_IDX(rows, i, acc_status_row);
+
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"%s%s %s %" APR_UINT64_T_FMT,
+			row->server ? "" : "key:",
+			ap_escape_logitem(r->pool, row->server ? row->server : row->key),
+			row->prefix ? ap_escape_logitem(r->pool, row->prefix) : "-",
+			ACC_ATOMIC_LOAD(&(row->counters->requests))
+		);
+
+		for (j = 0; j < ACC_METRICS; j++)
+		{
+			if (!(metrics[j].group & groups_enabled))
+				continue;
+
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				" %" APR_UINT64_T_FMT,
+				ACC_ATOMIC_LOAD(&(row->counters->value[j]))
+			);
+		}
+
+		apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n");
+	}
+
+	status_text_percentiles(r, bb, rows);
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "# anomalies");
+	for (j = 0; j < ACC_ANOMALIES; j++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			" %s=%" APR_UINT64_T_FMT,
+			anomaly_names[j],
+			ACC_ATOMIC_LOAD(&(shm_header->h.anomalies[j]))
+		);
+	}
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n");
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "# children");
+	for (j = 0; j < ACC_LIFETIMES; j++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			" %s=%" APR_UINT64_T_FMT,
+			lifetime_names[j],
+			ACC_ATOMIC_LOAD(&(shm_header->h.lifetimes[j]))
+		);
+	}
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n");
+
+	if (shm_header->h.keys)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"# keys capacity=%u dropped=%" APR_UINT64_T_FMT "\n",
+			(unsigned) shm_header->h.keys,
+			ACC_ATOMIC_LOAD(&(shm_header->h.keys_dropped))
+		);
+	}
+
+	if (!shm_header->h.hitter_sets)
+		return;
+
+	for (j = 0; j < ACC_HITTERS; j++)
+	{
+		const apr_array_header_t *top = hitter_top(r, j);
+
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"# top %s: %scpu error requests\n",
+			hitter_names[j],
+			j == ACC_HITTER_URI ? "server|key:name uri " : "client "
+		);
+
+		for (i = 0; i < top->nelts; i++)
+		{
+			const acc_hitter *hitter = &APR_ARRAY_IDX(top, i, acc_hitter);
+
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				"%s%s%s%s %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT "\n",
+				hitter->key_id ? "key:" : "",
+				j != ACC_HITTER_URI ? "" : ap_escape_logitem(r->pool, hitter->key_id ? key_name(hitter->key_id) : server_name(hitter->server)),
+				j == ACC_HITTER_URI ? " " : "",
+				ap_escape_logitem(r->pool, hitter->key),
+				hitter->cpu,
+				hitter->error,
+				hitter->requests
+			);
+		}
+	}
+} // }}}
+
+
+static void status_json(request_rec *r, apr_bucket_brigade *bb, const apr_array_header_t *rows){ // {{{
+	int i, j;
+
+	apr_brigade_printf(
+		bb,
+		ap_filter_flush,
+		r->output_filters,
+		"{\"since\":%" APR_TIME_T_FMT ",\"servers\":[",
+		apr_time_sec(shm_header->h.created)
+	);
+
+	for (i = 0; i < rows->nelts; i++)
+	{
+		const acc_status_row *row = &APR_ARRAY_IDX(rows, i, acc_status_row);
+
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"%s\n{\"%s\":\"%s\"",
+			i ? "," : "",
+			row->server ? "server" : "key",
+			json_escape(r->pool, row->server ? row->server : row->key)
+		);
+
+		if (row->prefix)
+		{
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				",\"prefix\":\"%s\"",
+				json_escape(r->pool, row->prefix)
+			);
+		}
+
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			",\"requests\":%" APR_UINT64_T_FMT,
+			ACC_ATOMIC_LOAD(&(row->counters->requests))
+		);
+
+		for (j = 0; j < ACC_METRICS; j++)
+		{
+			if (!(metrics[j].group & groups_enabled))
+				continue;
+
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				",\"%s\":%" APR_UINT64_T_FMT,
+				metrics[j].name,
+				ACC_ATOMIC_LOAD(&(row->counters->value[j]))
+			);
+		}
+
+		for (j = 0; row->histograms && j < ACC_HISTOGRAMS; j++)
+		{
+			apr_uint64_t values[ACC_PERCENTILES];
+			int k;
+
+			histogram_percentiles(row->counters->histogram[j], values);
+
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				"%s\"%s\":{",
+				j ? "," : ",\"percentiles\":{",
+				histogram_names[j]
+			);
+
+			for (k = 0; k < ACC_PERCENTILES; k++)
+			{
+				apr_brigade_printf(
+					bb,
+					ap_filter_flush,
+					r->output_filters,
+					"%s\"p%d\":%" APR_UINT64_T_FMT,
+					k ? "," : "",
+					percentiles[k] % 10 ? percentiles[k] : percentiles[k] / 10,
+					values[k]
+				);
+			}
+
+			apr_brigade_puts(bb, ap_filter_flush, r->output_filters, j == ACC_HISTOGRAMS - 1 ? "}}" : "}");
+		}
+
+		apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "}");
+	}
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n],\"anomalies\":{");
+
+	for (j = 0; j < ACC_ANOMALIES; j++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"%s\"%s\":%" APR_UINT64_T_FMT,
+			j ? "," : "",
+			anomaly_names[j],
+			ACC_ATOMIC_LOAD(&(shm_header->h.anomalies[j]))
+		);
+	}
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "},\"children\":{");
+
+	for (j = 0; j < ACC_LIFETIMES; j++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"%s\"%s\":%" APR_UINT64_T_FMT,
+			j ? "," : "",
+			lifetime_names[j],
+			ACC_ATOMIC_LOAD(&(shm_header->h.lifetimes[j]))
+		);
+	}
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "}");
+
+	for (j = 0; shm_header->h.hitter_sets && j < ACC_HITTERS; j++)
+	{
+		const apr_array_header_t *top = hitter_top(r, j);
+
+		apr_brigade_printf(bb, ap_filter_flush, r->output_filters, ",\"top_%s\":[", hitter_names[j]);
+
+		for (i = 0; i < top->nelts; i++)
+		{
+			const acc_hitter *hitter = &APR_ARRAY_IDX(top, i, acc_hitter);
+
+			if (j == ACC_HITTER_URI)
+			{
+				apr_brigade_printf(
+					bb,
+					ap_filter_flush,
+					r->output_filters,
+					"%s\n{\"server\":\"%s\",\"uri\":\"%s\"",
+					i ? "," : "",
+					json_escape(r->pool, server_name(hitter->server)),
+					json_escape(r->pool, hitter->key)
+				);
+
+				if (hitter->key_id)
+				{
+					apr_brigade_printf(
+						bb,
+						ap_filter_flush,
+						r->output_filters,
+						",\"key\":\"%s\"",
+						json_escape(r->pool, key_name(hitter->key_id))
+					);
+				}
+			}
+			else
+			{
+				apr_brigade_printf(
+					bb,
+					ap_filter_flush,
+					r->output_filters,
+					"%s\n{\"client\":\"%s\"",
+					i ? "," : "",
+					json_escape(r->pool, hitter->key)
+				);
+			}
+
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				",\"cpu\":%" APR_UINT64_T_FMT ",\"error\":%" APR_UINT64_T_FMT ",\"requests\":%" APR_UINT64_T_FMT "}",
+				hitter->cpu,
+				hitter->error,
+				hitter->requests
+			);
+		}
+
+		apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "\n]");
+	}
+
+	apr_brigade_puts(bb, ap_filter_flush, r->output_filters, "}\n");
+} // }}}
+
+
+/* Print the label set of a row in the Prometheus exposition format */
+static const char *status_labels(apr_pool_t *p, const acc_status_row *row){ // {{{
+	if (row->key)
+		return apr_psprintf(p, "{key=\"%s\"}", label_escape(p, row->key));
+
+	if (row->prefix)
+	{
+		return apr_psprintf(
+			p,
+			"{server=\"%s\",prefix=\"%s\"}",
+			label_escape(p, row->server),
+			label_escape(p, row->prefix)
+		);
+	}
+
+	return apr_psprintf(p, "{server=\"%s\"}", label_escape(p, row->server));
+} // }}}
+
+
+static void status_prometheus(request_rec *r, apr_bucket_brigade *bb, const apr_array_header_t *rows){ // {{{
+	const char **labels = apr_palloc(r->pool, (rows->nelts + 1) * sizeof(const char*));
+	int i, j;
+
+	for (i = 0; i < rows->nelts; i++)
+		labels[i] = status_labels(r->pool, &APR_ARRAY_IDX(rows, i, acc_status_row));
+
+	/* All samples of a metric have to be grouped together */
+	apr_brigade_puts(
+		bb,
+		ap_filter_flush,
+		r->output_filters,
+		"# HELP accounting_requests_total Accounted requests.\n"
+		"# TYPE accounting_requests_total counter\n"
 	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:data->begin_own_usage.ru_utime",
-		data->begin_own_usage.ru_utime
+
+	for (i = 0; i < rows->nelts; i++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"accounting_requests_total%s %" APR_UINT64_T_FMT "\n",
+			labels[i],
+			ACC_ATOMIC_LOAD(&(APR_ARRAY_IDX(rows, i, acc_status_row).counters->requests))
+		);
+	}
+
+	for (j = 0; j < ACC_METRICS; j++)
+	{
+		if (!(metrics[j].group & groups_enabled))
+			continue;
+
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"# HELP accounting_%s_%s_total Accounted %s in %s.\n"
+			"# TYPE accounting_%s_%s_total counter\n",
+			metrics[j].name, metrics[j].unit,
+			metrics[j].name, metrics[j].unit,
+			metrics[j].name, metrics[j].unit
+		);
+
+		for (i = 0; i < rows->nelts; i++)
+		{
+			apr_brigade_printf(
+				bb,
+				ap_filter_flush,
+				r->output_filters,
+				"accounting_%s_%s_total%s %" APR_UINT64_T_FMT "\n",
+				metrics[j].name,
+				metrics[j].unit,
+				labels[i],
+				ACC_ATOMIC_LOAD(&(APR_ARRAY_IDX(rows, i, acc_status_row).counters->value[j]))
+			);
+		}
+	}
+
+	for (j = 0; j < ACC_HISTOGRAMS; j++)
+	{
+		int header = 0;
+
+		for (i = 0; i < rows->nelts; i++)
+		{
+			const acc_status_row *row = &APR_ARRAY_IDX(rows, i, acc_status_row);
+			apr_uint64_t values[ACC_PERCENTILES];
+			int k;
+
+			if (!row->histograms)
+				continue;
+
+			if (!header)
+			{
+				apr_brigade_printf(
+					bb,
+					ap_filter_flush,
+					r->output_filters,
+					"# HELP accounting_%s_microseconds Percentiles of the %s of requests.\n"
+					"# TYPE accounting_%s_microseconds gauge\n",
+					histogram_names[j], histogram_names[j],
+					histogram_names[j]
+				);
+				header = 1;
+			}
+
+			histogram_percentiles(row->counters->histogram[j], values);
+
+			/* The labels of the row, with the quantile added */
+			for (k = 0; k < ACC_PERCENTILES; k++)
+			{
+				apr_brigade_printf(
+					bb,
+					ap_filter_flush,
+					r->output_filters,
+					"accounting_%s_microseconds%.*s,quantile=\"%d.%03d\"} %" APR_UINT64_T_FMT "\n",
+					histogram_names[j],
+					(int) strlen(labels[i]) - 1,
+					labels[i],
+					percentiles[k] / 1000,
+					percentiles[k] % 1000,
+					values[k]
+				);
+			}
+		}
+	}
+
+	apr_brigade_puts(
+		bb,
+		ap_filter_flush,
+		r->output_filters,
+		"# HELP accounting_anomalies_total Measuring anomalies, by type.\n"
+		"# TYPE accounting_anomalies_total counter\n"
 	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:data->begin_own_usage.ru_stime",
-		data->begin_own_usage.ru_stime
+
+	for (j = 0; j < ACC_ANOMALIES; j++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"accounting_anomalies_total{type=\"%s\"} %" APR_UINT64_T_FMT "\n",
+			anomaly_names[j],
+			ACC_ATOMIC_LOAD(&(shm_header->h.anomalies[j]))
+		);
+	}
+
+	for (j = 0; j < ACC_LIFETIMES; j++)
+	{
+		apr_brigade_printf(
+			bb,
+			ap_filter_flush,
+			r->output_filters,
+			"# HELP accounting_children_%s_total Totals of the children that exited.\n"
+			"# TYPE accounting_children_%s_total counter\n"
+			"accounting_children_%s_total %" APR_UINT64_T_FMT "\n",
+			lifetime_names[j],
+			lifetime_names[j],
+			lifetime_names[j],
+			ACC_ATOMIC_LOAD(&(shm_header->h.lifetimes[j]))
+		);
+	}
+} // }}}
+
+
+/* The accounting-status handler */
+static int module_accounting_status(request_rec *r){ // {{{
+	apr_bucket_brigade *bb;
+	int format = ACC_FORMAT_TEXT;
+
+	if (r->handler == NULL || strcmp(r->handler, ACC_STATUS_HANDLER))
+		return DECLINED;
+
+	if (r->method_number != M_GET)
+		return HTTP_METHOD_NOT_ALLOWED;
+
+	if (r->args && !strcmp(r->args, "json"))
+		format = ACC_FORMAT_JSON;
+	else if (r->args && !strcmp(r->args, "prometheus"))
+		format = ACC_FORMAT_PROMETHEUS;
+
+	if (format == ACC_FORMAT_JSON)
+		ap_set_content_type(r, "application/json");
+	else if (format == ACC_FORMAT_PROMETHEUS)
+		ap_set_content_type(r, "text/plain; version=0.0.4");
+	else
+		ap_set_content_type(r, "text/plain");
+
+	if (r->header_only)
+		return OK;
+
+	if (shm_header == NULL)
+	{
+		ap_rputs("Neither AccountingAggregate nor AccountingHeavyHitters is enabled.\n", r);
+		return OK;
+	}
+
+	bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+
+	switch (format)
+	{
+		case ACC_FORMAT_JSON:
+			status_json(r, bb, status_rows(r));
+			break;
+		case ACC_FORMAT_PROMETHEUS:
+			status_prometheus(r, bb, status_rows(r));
+			break;
+		default:
+			status_text(r, bb, status_rows(r));
+	}
+
+	APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+	ap_pass_brigade(r->output_filters, bb);
+
+	return OK;
+} // }}}
+
+
+/* Register the %{...}Z log format item with mod_log_config */
+static int module_accounting_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp){ // {{{
+	APR_OPTIONAL_FN_TYPE(ap_register_log_handler) *register_log_handler;
+
+	register_log_handler = APR_RETRIEVE_OPTIONAL_FN(ap_register_log_handler);
+
+	if (register_log_handler)
+		register_log_handler(pconf, "Z", log_accounting_item, 0);
+
+	return OK;
+} // }}}
+
+
+/* Fill in the header of a new segment, which is all zeroes otherwise */
+static void shm_init(apr_size_t size, apr_uint64_t layout, int slots, int hitter_sets, int keys, int exported){ // {{{
+	shm_header->h.magic = ACC_STATE_MAGIC;
+	shm_header->h.version = ACC_STATE_VERSION;
+	shm_header->h.size = size;
+	shm_header->h.layout = layout;
+	shm_header->h.slots = slots;
+	shm_header->h.hitter_sets = hitter_sets;
+	shm_header->h.keys = keys;
+	shm_header->h.exported = exported;
+	shm_header->h.created = apr_time_now();
+} // }}}
+
+
+/* Attach the segment to an AccountingStateFile
+ *
+ * A file that doesn't match is replaced by a new one, as the children of
+ * the previous generation may still have the old one mapped, and it's
+ * extended to its size, which leaves it all zeroes without writing a
+ * byte of it.
+ */
+static apr_status_t attach_state(apr_pool_t *pconf, server_rec *s, const char *fname, apr_size_t size, apr_uint64_t layout, int slots, int hitter_sets, int keys, int exported){ // {{{
+	apr_status_t rv;
+	apr_file_t *file;
+	apr_finfo_t finfo;
+	apr_mmap_t *mm;
+	acc_shm_header header;
+	apr_size_t read;
+	int keep = 0;
+
+	rv = apr_file_open(
+		&file,
+		fname,
+		APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_BINARY,
+		APR_OS_DEFAULT,
+		pconf
 	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:data->begin_own_usage.ru_inblock",
-		data->begin_own_usage.ru_inblock
+
+	if (rv == APR_SUCCESS &&
+		apr_file_info_get(&finfo, APR_FINFO_SIZE, file) == APR_SUCCESS &&
+		finfo.size == (apr_off_t) size &&
+		apr_file_read_full(file, &header, sizeof(header), &read) == APR_SUCCESS)
+	{
+		keep = header.h.magic == ACC_STATE_MAGIC &&
+			header.h.version == ACC_STATE_VERSION &&
+			header.h.size == size &&
+			header.h.layout == layout &&
+			header.h.slots == (apr_uint32_t) slots &&
+			header.h.hitter_sets == (apr_uint32_t) hitter_sets &&
+			header.h.keys == (apr_uint32_t) keys &&
+			header.h.exported == (apr_uint32_t) exported;
+	}
+
+	if (!keep)
+	{
+		if (rv == APR_SUCCESS)
+			apr_file_close(file);
+
+		apr_file_remove(fname, pconf);
+
+		rv = apr_file_open(
+			&file,
+			fname,
+			APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_EXCL | APR_FOPEN_BINARY,
+			APR_FPROT_UREAD | APR_FPROT_UWRITE,
+			pconf
+		);
+
+		if (rv == APR_SUCCESS)
+			rv = apr_file_trunc(file, size);
+	}
+
+	if (rv == APR_SUCCESS)
+		rv = apr_mmap_create(&mm, file, 0, size, APR_MMAP_READ | APR_MMAP_WRITE, pconf);
+
+	if (rv != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			s,
+			"Failed to map the accounting state file %s",
+			fname
+		);
+		return rv;
+	}
+
+	/* The mapping outlives the file */
+	apr_file_close(file);
+
+	shm_header = mm->mm;
+
+	if (!keep)
+	{
+		shm_init(size, layout, slots, hitter_sets, keys, exported);
+		return APR_SUCCESS;
+	}
+
+	/* The locks of the heavy hitters are left alone, as the children of
+	 * the previous generation may still hold them; one that was left by a
+	 * child that died only makes hitter_add() drop its updates, see
+	 * hitter_lock() */
+	ap_log_error(
+		APLOG_MARK,
+		APLOG_INFO,
+		APR_SUCCESS,
+		s,
+		"Continuing the accounting counters in %s",
+		fname
 	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:data->begin_own_usage.ru_oublock",
-		data->begin_own_usage.ru_oublock
+
+	return APR_SUCCESS;
+} // }}}
+
+
+/* Create the shared memory for the aggregated counters
+ *
+ * The segment lives in pconf, so every (graceful) restart starts with
+ * fresh counters, unless it's kept in an AccountingStateFile. Anonymous
+ * shared memory is used where available, else a file based segment next
+ * to the logs.
+ */
+static apr_status_t create_shm(apr_pool_t *pconf, server_rec *s, const char *state_file, apr_uint64_t layout, int slots, int hitter_sets, int keys, int exported){ // {{{
+	apr_status_t rv;
+	apr_shm_t *shm;
+	apr_size_t size = sizeof(acc_shm_header) + slots * sizeof(acc_slot) +
+		ACC_HITTERS * hitter_sets * sizeof(acc_hitter_set) +
+		keys * (sizeof(acc_key) + sizeof(acc_slot)) +
+		(exported ? slots * sizeof(acc_totals) : 0);
+	const char *fname;
+
+	if (state_file)
+	{
+		fname = ap_server_root_relative(pconf, state_file);
+		return attach_state(pconf, s, fname, size, layout, slots, hitter_sets, keys, exported);
+	}
+
+	rv = apr_shm_create(&shm, size, NULL, pconf);
+	if (rv == APR_ENOTIMPL)
+	{
+		fname = ap_server_root_relative(pconf, "logs/accounting.shm");
+		apr_shm_remove(fname, pconf);
+		rv = apr_shm_create(&shm, size, fname, pconf);
+	}
+
+	if (rv != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			s,
+			"Failed to create shared memory for %d accounting slots, %d heavy hitters and %d keys",
+			slots,
+			hitter_sets * ACC_HITTER_WAYS,
+			keys
+		);
+		return rv;
+	}
+
+	shm_header = apr_shm_baseaddr_get(shm);
+	memset(shm_header, 0, size);
+	shm_init(size, 0, slots, hitter_sets, keys, exported);
+
+	return APR_SUCCESS;
+} // }}}
+
+
+/* Open the binary log in the parent, so the children inherit it */
+static int module_accounting_open_logs(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s){ // {{{
+	acc_server_conf *conf = ap_get_module_config(s->module_config, &accounting_module);
+	apr_status_t rv;
+	piped_log *pl;
+	const char *fname;
+
+	binlog.file = NULL;
+
+	if (conf->binlog_path == NULL)
+		return OK;
+
+	if (*conf->binlog_path == '|')
+	{
+		if ((pl = ap_open_piped_log(pconf, conf->binlog_path + 1)) == NULL)
+		{
+			ap_log_error(
+				APLOG_MARK,
+				APLOG_ERR,
+				APR_SUCCESS,
+				s,
+				"Failed to start accounting log program %s",
+				conf->binlog_path + 1
+			);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		binlog.file = ap_piped_log_write_fd(pl);
+
+		/* Keep every write atomic */
+		if (conf->binlog_buffer > PIPE_BUF)
+			conf->binlog_buffer = PIPE_BUF;
+
+		return OK;
+	}
+
+	fname = ap_server_root_relative(pconf, conf->binlog_path);
+	rv = apr_file_open(
+		&(binlog.file),
+		fname,
+		APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_APPEND | APR_FOPEN_BINARY | APR_FOPEN_LARGEFILE,
+		APR_OS_DEFAULT,
+		pconf
 	);
 
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:data->begin_child_usage.ru_utime",
-		data->begin_child_usage.ru_utime
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:data->begin_child_usage.ru_stime",
-		data->begin_child_usage.ru_stime
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:data->begin_child_usage.ru_inblock",
-		data->begin_child_usage.ru_inblock
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:data->begin_child_usage.ru_oublock",
-		data->begin_child_usage.ru_oublock
-	);
+	if (rv != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			s,
+			"Failed to open accounting log %s",
+			fname
+		);
+		binlog.file = NULL;
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	return OK;
+} // }}}
+
+
+/* Write a value to a cgroup file */
+static int cgroup_write(apr_pool_t *p, const char *dir, const char *file, const char *value){ // {{{
+	const char *path = apr_pstrcat(p, dir, "/", file, NULL);
+	apr_size_t len = strlen(value);
+	int fd, rv = 0;
+
+	if ((fd = open(path, O_WRONLY)) == -1)
+		return -1;
+
+	if (write(fd, value, len) != (ssize_t) len)
+		rv = -1;
+
+	close(fd);
+	return rv;
+} // }}}
+
+
+/* Remove the leaves of children that are gone
+ *
+ * A cgroup can't be removed while it has processes, so this only removes
+ * the empty ones. */
+static void cgroup_sweep(apr_pool_t *p, const char *root){ // {{{
+	struct dirent *entry;
+	DIR *dir;
+
+	if ((dir = opendir(root)) == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+			rmdir(apr_pstrcat(p, root, "/", entry->d_name, NULL));
+	}
+
+	closedir(dir);
+} // }}}
+
+
+/* Prepare the delegated directory, in the parent
+ *
+ * The parent moves itself into a leaf of its own, as controllers can only
+ * be enabled for cgroups without processes, and hands the directory over
+ * to the user the children run as, so they can create and join their
+ * leaves after dropping their privileges.
+ */
+static int cgroup_parent_init(apr_pool_t *p, server_rec *s, const char *root){ // {{{
+	const char *parent = apr_pstrcat(p, root, "/", ACC_CGROUP_PARENT, NULL);
+	uid_t uid;
+	gid_t gid;
+
+	if ((mkdir(parent, 0755) == -1 && errno != EEXIST) ||
+		cgroup_write(p, parent, "cgroup.procs", apr_psprintf(p, "%" APR_PID_T_FMT, getpid())) == -1)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_WARNING,
+			APR_FROM_OS_ERROR(errno),
+			s,
+			"Failed to move the server into %s, AccountingCgroup disabled",
+			parent
+		);
+		return -1;
+	}
+
+	/* Without these cgroup_usage() only gets the CPU time */
+	cgroup_write(p, root, "cgroup.subtree_control", "+cpu");
+	cgroup_write(p, root, "cgroup.subtree_control", "+io");
+	cgroup_write(p, root, "cgroup.subtree_control", "+memory");
+
+#if AP_MODULE_MAGIC_AT_LEAST(20081201, 0)
+	uid = ap_unixd_config.user_id;
+	gid = ap_unixd_config.group_id;
+#else
+	uid = unixd_config.user_id;
+	gid = unixd_config.group_id;
+#endif
+
+	if (geteuid() == 0 &&
+		(chown(root, uid, gid) == -1 ||
+		chown(apr_pstrcat(p, root, "/cgroup.procs", NULL), uid, gid) == -1))
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_WARNING,
+			APR_FROM_OS_ERROR(errno),
+			s,
+			"Failed to delegate %s, AccountingCgroup disabled",
+			root
+		);
+		return -1;
+	}
+
+	cgroup_sweep(p, root);
+
+	return 0;
+} // }}}
+
+
+/* Create and join the leaf of a child */
+static void cgroup_child_init(apr_pool_t *p, server_rec *s){ // {{{
+	const acc_server_conf *main_conf = ap_get_module_config(s->module_config, &accounting_module);
+	const char *pid, *leaf;
+
+	if (main_conf->cgroup_root == NULL)
+		return;
+
+	/* Leaves of earlier children that have exited are empty now */
+	cgroup_sweep(p, main_conf->cgroup_root);
+
+	pid = apr_psprintf(p, "%" APR_PID_T_FMT, getpid());
+	leaf = apr_pstrcat(p, main_conf->cgroup_root, "/", pid, NULL);
+
+	if ((mkdir(leaf, 0755) == -1 && errno != EEXIST) ||
+		cgroup_write(p, leaf, "cgroup.procs", pid) == -1)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_WARNING,
+			APR_FROM_OS_ERROR(errno),
+			s,
+			"Failed to join cgroup %s",
+			leaf
+		);
+		return;
+	}
+
+	cgroup.cpu_stat = open(apr_pstrcat(p, leaf, "/cpu.stat", NULL), O_RDONLY);
+	cgroup.io_stat = open(apr_pstrcat(p, leaf, "/io.stat", NULL), O_RDONLY);
+	cgroup.memory_peak = open(apr_pstrcat(p, leaf, "/memory.peak", NULL), O_RDWR);
+	cgroup.peak_reset = cgroup.memory_peak != -1;
+} // }}}
+
+
+#if APR_HAS_THREADS
+/* A set of counters to export, with its statsd name */
+typedef struct {
+	const char         *name;
+	const acc_counters *counters;
+	acc_totals         *exported;
+} acc_export_row;
+
+typedef struct {
+	apr_thread_t        *thread;
+	apr_thread_mutex_t  *mutex;
+	apr_thread_cond_t   *cond;
+	int                  stop;
+	apr_time_t           interval;
+	apr_socket_t        *socket;
+	apr_sockaddr_t      *addr;
+	char                *packet;
+	apr_size_t           size;
+	apr_size_t           used;
+	apr_array_header_t  *rows;
+} acc_exporter;
+
+static acc_exporter exporter;
+
+
+/* A name as a statsd name component */
+static char *export_name(apr_pool_t *p, const char *name){ // {{{
+	char *c, *copy = apr_pstrdup(p, name);
+
+	for (c = copy; *c; c++)
+	{
+		if (!apr_isalnum(*c) && *c != '-' && *c != '_')
+			*c = '_';
+	}
+
+	return copy;
+} // }}}
+
+
+static void export_send(void){ // {{{
+	apr_size_t len = exporter.used;
+
+	if (len)
+		apr_socket_sendto(exporter.socket, exporter.addr, 0, exporter.packet, &len);
+
+	exporter.used = 0;
+} // }}}
+
+
+/* Add a counter to the packet, sending the packet first when it's full */
+static void export_counter(const char *row, const char *name, apr_uint64_t delta){ // {{{
+	char line[512];
+	int len;
+
+	len = apr_snprintf(line, sizeof(line), "accounting.%s.%s:%" APR_UINT64_T_FMT "|c\n", row, name, delta);
+
+	if (len >= (int) sizeof(line) || (apr_size_t) len > exporter.size)
+		return;
+
+	if (exporter.used + len > exporter.size)
+		export_send();
+
+	memcpy(exporter.packet + exporter.used, line, len);
+	exporter.used += len;
+} // }}}
+
+
+static apr_uint64_t export_delta(const apr_uint64_t *counter, apr_uint64_t *exported){ // {{{
+	apr_uint64_t value = ACC_ATOMIC_LOAD(counter);
+	apr_uint64_t delta = value - *exported;
+
+	*exported = value;
+	return delta;
+} // }}}
+
+
+/* Export the growth of the counters, if it's this child's turn */
+static void export_run(void){ // {{{
+	apr_uint32_t tick, seen;
+	apr_uint64_t delta;
+	int i, j;
+
+	tick = (apr_uint32_t) ((apr_time_now() - shm_header->h.created) / exporter.interval);
+	seen = apr_atomic_read32(&(shm_header->h.export_tick));
+
+	if (tick == seen || apr_atomic_cas32(&(shm_header->h.export_tick), tick, seen) != seen)
+		return;
+
+	for (i = 0; i < exporter.rows->nelts; i++)
+	{
+		const acc_export_row *row = &APR_ARRAY_IDX(exporter.rows, i, acc_export_row);
+
+		/* Idle servers take no room */
+		if ((delta = export_delta(&(row->counters->requests), &(row->exported->requests))) == 0)
+			continue;
+
+		export_counter(row->name, "requests", delta);
+
+		for (j = 0; j < ACC_METRICS; j++)
+		{
+			if (!(metrics[j].group & groups_enabled))
+				continue;
+
+			if ((delta = export_delta(&(row->counters->value[j]), &(row->exported->value[j]))) != 0)
+				export_counter(row->name, metrics[j].name, delta);
+		}
+	}
+
+	export_send();
+} // }}}
+
+
+static void * APR_THREAD_FUNC export_thread(apr_thread_t *thread, void *dummy){ // {{{
+	apr_thread_mutex_lock(exporter.mutex);
+
+	while (!exporter.stop)
+	{
+		apr_thread_cond_timedwait(exporter.cond, exporter.mutex, exporter.interval);
+
+		if (!exporter.stop)
+			export_run();
+	}
+
+	apr_thread_mutex_unlock(exporter.mutex);
+	apr_thread_exit(thread, APR_SUCCESS);
+
+	return NULL;
+} // }}}
+
+
+/* Stop the thread before the memory it uses is gone */
+static apr_status_t export_cleanup(void *dummy){ // {{{
+	apr_status_t rv;
+
+	apr_thread_mutex_lock(exporter.mutex);
+	exporter.stop = 1;
+	apr_thread_cond_signal(exporter.cond);
+	apr_thread_mutex_unlock(exporter.mutex);
+
+	apr_thread_join(&rv, exporter.thread);
+
+	return APR_SUCCESS;
+} // }}}
+
+
+/* Start the export thread of a child */
+static void export_child_init(apr_pool_t *p, server_rec *s){ // {{{
+	const acc_server_conf *main_conf = ap_get_module_config(s->module_config, &accounting_module);
+	acc_totals *exported;
+	acc_export_row *row;
+	apr_status_t rv;
+	server_rec *vs;
+	int i;
+
+	if (main_conf->export_host == NULL || shm_header == NULL || !shm_header->h.exported)
+		return;
+
+	memset(&exporter, 0, sizeof(exporter));
+	exporter.interval = main_conf->export_interval;
+	exporter.size = main_conf->export_packet;
+	exporter.packet = apr_palloc(p, exporter.size);
+
+	if ((rv = apr_sockaddr_info_get(&(exporter.addr), main_conf->export_host, APR_UNSPEC, main_conf->export_port, 0, p)) != APR_SUCCESS ||
+		(rv = apr_socket_create(&(exporter.socket), exporter.addr->family, SOCK_DGRAM, APR_PROTO_UDP, p)) != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			s,
+			"Failed to set up accounting export to %s:%d",
+			main_conf->export_host,
+			(int) main_conf->export_port
+		);
+		return;
+	}
+
+	/* The statsd names of all counters */
+	exported = SHM_EXPORTED();
+	exporter.rows = apr_array_make(p, 16, sizeof(acc_export_row));
+
+	for (vs = s; vs; vs = vs->next)
+	{
+		const acc_server_conf *conf = ap_get_module_config(vs->module_config, &accounting_module);
+		const char *name = export_name(p, conf->name);
+
+		if (!conf->aggregate)
+			continue;
+
+		row = apr_array_push(exporter.rows);
+		row->name = name;
+		row->counters = &(SHM_SLOTS()[conf->slot].counters);
+		row->exported = &(exported[conf->slot]);
+
+		for (i = 0; conf->prefixes && i < conf->prefixes->nelts; i++)
+		{
+			const acc_prefix *prefix = &APR_ARRAY_IDX(conf->prefixes, i, acc_prefix);
+
+			row = apr_array_push(exporter.rows);
+			row->name = apr_pstrcat(p, name, ".", export_name(p, prefix->prefix), NULL);
+			row->counters = &(SHM_SLOTS()[prefix->slot].counters);
+			row->exported = &(exported[prefix->slot]);
+		}
+	}
+
+	if ((rv = apr_thread_mutex_create(&(exporter.mutex), APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS ||
+		(rv = apr_thread_cond_create(&(exporter.cond), p)) != APR_SUCCESS ||
+		(rv = apr_thread_create(&(exporter.thread), NULL, export_thread, NULL, p)) != APR_SUCCESS)
+	{
+		ap_log_error(
+			APLOG_MARK,
+			APLOG_ERR,
+			rv,
+			s,
+			"Failed to start the accounting export thread"
+		);
+		return;
+	}
+
+	apr_pool_pre_cleanup_register(p, NULL, export_cleanup);
+} // }}}
+#endif
+
+
+static void module_accounting_child_init(apr_pool_t *p, server_rec *s){ // {{{
+	binlog_child_init(p, s);
+	cgroup_child_init(p, s);
+#if APR_HAS_THREADS
+	export_child_init(p, s);
+#endif
+	lifetime_child_init(p, s);
+} // }}}
+
+
+/* FNV-1a hash of a name */
+static apr_uint32_t hash_name(const char *name){ // {{{
+	apr_uint32_t hash = 2166136261U;
+
+	for (; *name; name++)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 16777619U;
+	}
+
+	return hash;
+} // }}}
+
+
+/* Resolve the configuration
+ *
+ * The automatic CPU source can only be resolved once the MPM is known,
+ * so do that here for every server.
+ */
+static int module_accounting_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s){ // {{{
+	acc_server_conf *main_conf = ap_get_module_config(s->module_config, &accounting_module);
+	int threaded = 0;
+	int slots = 0;
+	int any_aggregate = 0;
+	int any_key = 0;
+	apr_uint64_t layout = ACC_METRICS;
+	int hitter_sets;
+	int keys;
+	int i;
+	server_rec *vs;
+
+	groups_enabled = ACC_GROUP_TIME | ACC_GROUP_BASE | ACC_GROUP_CHILDREN;
+	key_histograms = 0;
+
+	if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS)
+		threaded = AP_MPMQ_NOT_SUPPORTED;
+
+	for (vs = s; vs; vs = vs->next)
+	{
+		acc_server_conf *conf = ap_get_module_config(vs->module_config, &accounting_module);
+
+		if (conf->cpu_source == ACC_CPU_UNSET || conf->cpu_source == ACC_CPU_AUTO)
+			conf->cpu_source = threaded != AP_MPMQ_NOT_SUPPORTED ? ACC_CPU_THREAD : ACC_CPU_PROCESS;
+
+		if (conf->clock == ACC_CLOCK_UNSET)
+			conf->clock = ACC_CLOCK_MONOTONIC;
+
+		if (conf->anomaly_interval == -1)
+			conf->anomaly_interval = ACC_ANOMALY_DEFAULT_INTERVAL;
+
+		/* Notes are on unless switched off, for existing LogFormats */
+		if (conf->notes == -1)
+			conf->notes = 1;
+
+		/* Tracing is off unless asked for */
+		if (conf->trace == -1)
+			conf->trace = 0;
+
+		/* Reap after mod_cgi's handler by default */
+		if (conf->reap == ACC_REAP_UNSET)
+			conf->reap = ACC_REAP_HANDLER;
+
+		if (conf->reap_handlers == NULL)
+		{
+			conf->reap_handlers = apr_array_make(pconf, 2, sizeof(const char*));
+			APR_ARRAY_PUSH(conf->reap_handlers, const char*) = "cgi-script";
+			APR_ARRAY_PUSH(conf->reap_handlers, const char*) = "application/x-httpd-cgi";
+		}
+
+		/* How the server is identified in reports and logs */
+		conf->name = apr_psprintf(
+			pconf,
+			"%s:%d",
+			vs->server_hostname ? vs->server_hostname : "",
+			(int) vs->port
+		);
+		conf->id = hash_name(conf->name);
+
+		if (conf->conn_snapshot == -1)
+			conf->conn_snapshot = 0;
+
+		if (conf->lean == -1)
+			conf->lean = 0;
+
+		if (!conf->lean)
+			groups_enabled |= ACC_GROUP_RUSAGE;
+
+		/* Everything is measured unless sampling was asked for */
+		if (conf->sample_rate == -1)
+			conf->sample_rate = 1;
+
+		if (conf->slow_threshold == -1)
+			conf->slow_threshold = 0;
+
+		if (conf->phases == -1)
+			conf->phases = 0;
+
+		if (conf->phases)
+			groups_enabled |= ACC_GROUP_PHASES;
+
+		if (conf->bytes == -1)
+			conf->bytes = 0;
+
+		if (conf->bytes)
+			groups_enabled |= ACC_GROUP_BYTES;
+
+		if (conf->thread_io == -1)
+			conf->thread_io = 0;
+
+		if (conf->thread_io)
+			groups_enabled |= ACC_GROUP_IO;
+
+		if (conf->memory == -1)
+			conf->memory = 0;
+
+		if (conf->subrequests == -1)
+			conf->subrequests = 0;
+
+		if (conf->memory)
+			groups_enabled |= ACC_GROUP_MEMORY;
+
+		if (conf->backend == -1)
+			conf->backend = conf->backend_header != NULL;
+
+		if (conf->backend)
+			groups_enabled |= ACC_GROUP_BACKEND;
+
+		/* Every server gets its own counters */
+		if (conf->aggregate == -1)
+			conf->aggregate = 0;
+
+		/* Histograms are kept with the aggregated counters */
+		if (conf->histograms == -1 || !conf->aggregate)
+			conf->histograms = 0;
+
+		if (conf->budget == -1)
+			conf->budget = 0;
+
+		if (conf->budget_action == ACC_BUDGET_UNSET)
+			conf->budget_action = ACC_BUDGET_REJECT;
+
+		/* A key is only of use with counters or heavy hitters */
+		if (conf->key_source == ACC_KEY_UNSET)
+			conf->key_source = ACC_KEY_NONE;
+
+		if (!conf->aggregate && !main_conf->hitters)
+			conf->key_source = ACC_KEY_NONE;
+
+		if (conf->key_source != ACC_KEY_NONE)
+		{
+			any_key = 1;
+			key_histograms |= conf->histograms;
+		}
+
+		/* The budget is kept in the slot of the server, like the
+		 * aggregated counters */
+		any_aggregate |= conf->aggregate || conf->budget;
+		conf->slot = slots++;
+		layout = layout * 1099511628211ULL ^ conf->id;
+
+		if (conf->prefixes)
+		{
+			for (i = 0; i < conf->prefixes->nelts; i++)
+			{
+				APR_ARRAY_IDX(conf->prefixes, i, acc_prefix).slot = slots++;
+				layout = layout * 1099511628211ULL ^ hash_name(APR_ARRAY_IDX(conf->prefixes, i, acc_prefix).prefix);
+			}
+		}
+	}
+
+	/* The cgroup leaves are per process, threads would share them */
+	if (main_conf->cgroup_root)
+	{
+		if (threaded != AP_MPMQ_NOT_SUPPORTED)
+		{
+			ap_log_error(
+				APLOG_MARK,
+				APLOG_WARNING,
+				APR_SUCCESS,
+				s,
+				"AccountingCgroup needs a non-threaded MPM, ignored"
+			);
+			main_conf->cgroup_root = NULL;
+		}
+		else if (cgroup_parent_init(ptemp, s, main_conf->cgroup_root) == -1)
+			main_conf->cgroup_root = NULL;
+		else
+			groups_enabled |= ACC_GROUP_CGROUP;
+	}
+
+	/* Forget the segment of the previous generation */
+	shm_header = NULL;
+	acc_servers = s;
+
+	hitter_sets = (main_conf->hitters + ACC_HITTER_WAYS - 1) / ACC_HITTER_WAYS;
+
+	/* A power of two, so probing just masks the hash */
+	keys = 0;
+	if (any_key)
+	{
+		for (keys = 1; keys < (main_conf->keys ? main_conf->keys : ACC_KEYS_DEFAULT); keys <<= 1)
+			;
+	}
+
+	/* There's nothing to export without aggregated counters */
+	if (!any_aggregate)
+		main_conf->export_host = NULL;
+
+	if ((any_aggregate || hitter_sets) &&
+		create_shm(pconf, s, main_conf->state_file, layout, slots, hitter_sets, keys, main_conf->export_host != NULL) != APR_SUCCESS)
+	{
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	return OK;
+} // }}}
+
+
+static void *create_dir_config(apr_pool_t *p, char *dir){ // {{{
+	acc_dir_conf *conf = apr_pcalloc(p, sizeof(acc_dir_conf));
+
+	conf->enabled = -1;
+	conf->selected = NULL;
+
+	return conf;
+} // }}}
+
+
+static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv){ // {{{
+	acc_dir_conf *base = basev;
+	acc_dir_conf *add = addv;
+	acc_dir_conf *conf = apr_pcalloc(p, sizeof(acc_dir_conf));
+
+	conf->enabled = add->enabled == -1 ? base->enabled : add->enabled;
+	conf->selected = add->selected ? add->selected : base->selected;
+
+	return conf;
+} // }}}
+
+
+static void *create_server_config(apr_pool_t *p, server_rec *s){ // {{{
+	acc_server_conf *conf = apr_pcalloc(p, sizeof(acc_server_conf));
+
+	conf->cpu_source = ACC_CPU_UNSET;
+	conf->clock = ACC_CLOCK_UNSET;
+	conf->anomaly_interval = -1;
+	conf->trace = -1;
+	conf->notes = -1;
+	conf->reap = ACC_REAP_UNSET;
+	conf->conn_snapshot = -1;
+	conf->lean = -1;
+	conf->sample_rate = -1;
+	conf->slow_threshold = -1;
+	conf->phases = -1;
+	conf->bytes = -1;
+	conf->thread_io = -1;
+	conf->memory = -1;
+	conf->subrequests = -1;
+	conf->backend = -1;
+	conf->aggregate = -1;
+	conf->histograms = -1;
+	conf->budget = -1;
+	conf->budget_action = ACC_BUDGET_UNSET;
+	conf->key_source = ACC_KEY_UNSET;
+	conf->binlog_buffer = ACC_BINLOG_DEFAULT_BUFFER;
+	conf->binlog_interval = ACC_BINLOG_DEFAULT_INTERVAL;
+	conf->export_interval = ACC_EXPORT_DEFAULT_INTERVAL;
+	conf->export_packet = ACC_EXPORT_DEFAULT_PACKET;
+
+	return conf;
+} // }}}
+
+
+static void *merge_server_config(apr_pool_t *p, void *basev, void *addv){ // {{{
+	acc_server_conf *base = basev;
+	acc_server_conf *add = addv;
+	acc_server_conf *conf = apr_pcalloc(p, sizeof(acc_server_conf));
+
+	conf->cpu_source = add->cpu_source == ACC_CPU_UNSET ? base->cpu_source : add->cpu_source;
+	conf->clock = add->clock == ACC_CLOCK_UNSET ? base->clock : add->clock;
+	conf->anomaly_interval = add->anomaly_interval == -1 ? base->anomaly_interval : add->anomaly_interval;
+	conf->trace = add->trace == -1 ? base->trace : add->trace;
+	conf->notes = add->notes == -1 ? base->notes : add->notes;
+	conf->reap = add->reap == ACC_REAP_UNSET ? base->reap : add->reap;
+	conf->reap_handlers = add->reap_handlers ? add->reap_handlers : base->reap_handlers;
+	conf->conn_snapshot = add->conn_snapshot == -1 ? base->conn_snapshot : add->conn_snapshot;
+	conf->lean = add->lean == -1 ? base->lean : add->lean;
+	conf->sample_rate = add->sample_rate == -1 ? base->sample_rate : add->sample_rate;
+	conf->slow_threshold = add->slow_threshold == -1 ? base->slow_threshold : add->slow_threshold;
+	conf->phases = add->phases == -1 ? base->phases : add->phases;
+	conf->memory = add->memory == -1 ? base->memory : add->memory;
+	conf->subrequests = add->subrequests == -1 ? base->subrequests : add->subrequests;
+	conf->bytes = add->bytes == -1 ? base->bytes : add->bytes;
+	conf->thread_io = add->thread_io == -1 ? base->thread_io : add->thread_io;
+	conf->backend = add->backend == -1 ? base->backend : add->backend;
+	conf->backend_header = add->backend_header ? add->backend_header : base->backend_header;
+	conf->aggregate = add->aggregate == -1 ? base->aggregate : add->aggregate;
+	conf->histograms = add->histograms == -1 ? base->histograms : add->histograms;
+	conf->budget = add->budget == -1 ? base->budget : add->budget;
+	conf->budget_window = add->budget == -1 ? base->budget_window : add->budget_window;
+	conf->budget_action = add->budget_action == ACC_BUDGET_UNSET ? base->budget_action : add->budget_action;
+	conf->budget_delay = add->budget_action == ACC_BUDGET_UNSET ? base->budget_delay : add->budget_delay;
+
+	conf->key_source = add->key_source == ACC_KEY_UNSET ? base->key_source : add->key_source;
+	conf->key_name = add->key_source == ACC_KEY_UNSET ? base->key_name : add->key_name;
+
+	/* Prefixes are per server, they each need their own counters */
+	conf->prefixes = add->prefixes;
+
+	/* So are the cgroups and the binary log */
+	conf->cgroup_root = base->cgroup_root;
+	conf->hitters = base->hitters;
+	conf->keys = base->keys;
+	conf->state_file = base->state_file;
+	conf->export_host = base->export_host;
+	conf->export_port = base->export_port;
+	conf->export_interval = base->export_interval;
+	conf->export_packet = base->export_packet;
+	conf->binlog_path = base->binlog_path;
+	conf->binlog_buffer = base->binlog_buffer;
+	conf->binlog_interval = base->binlog_interval;
+
+	return conf;
+} // }}}
+
+
+/* Accounting On|Off */
+static const char *set_enabled(cmd_parms *cmd, void *dconf, int flag){ // {{{
+	acc_dir_conf *conf = dconf;
+
+	conf->enabled = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingMetrics name [name] ...
+ *
+ * "all" selects every metric again, e.g. below a location that selected
+ * only some.
+ */
+static const char *add_metric(cmd_parms *cmd, void *dconf, const char *arg){ // {{{
+	acc_dir_conf *conf = dconf;
+	unsigned char *selected = (unsigned char*) conf->selected;
+	int i;
+
+	if (!strcasecmp(arg, "all"))
+	{
+		if (selected == NULL)
+			selected = apr_palloc(cmd->pool, ACC_METRICS);
+
+		memset(selected, 1, ACC_METRICS);
+		conf->selected = selected;
+		return NULL;
+	}
+
+	for (i = 0; i < ACC_METRICS; i++)
+	{
+		if (!strcmp(arg, metrics[i].name))
+			break;
+	}
+
+	if (i == ACC_METRICS)
+		return apr_pstrcat(cmd->pool, "Unknown accounting metric ", arg, NULL);
 
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:end_time",
-		end_time
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:end_own_usage.ru_utime",
-		end_own_usage.ru_utime
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:end_own_usage.ru_stime",
-		end_own_usage.ru_stime
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:end_own_usage.ru_inblock",
-		end_own_usage.ru_inblock
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:end_own_usage.ru_oublock",
-		end_own_usage.ru_oublock
-	);
+	if (selected == NULL)
+		selected = apr_pcalloc(cmd->pool, ACC_METRICS);
 
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:end_child_usage.ru_utime",
-		end_child_usage.ru_utime
-	);
-	ACC_LOG_DEBUG_TIME(
-		"accounting_stop:end_child_usage.ru_stime",
-		end_child_usage.ru_stime
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:end_child_usage.ru_inblock",
-		end_child_usage.ru_inblock
-	);
-	ACC_LOG_DEBUG_BLOCKS(
-		"accounting_stop:end_child_usage.ru_oublock",
-		end_child_usage.ru_oublock
-	); // }}}
-	
-	/* Set the time difference between start and stop */
-	apr_table_setn(
-		last->notes,
-		notes_key_time,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			time_difference(
-				last,
-				&(data->begin_time),
-				&(end_time)
-			)
-		)
-	);
-	
-	/* Set the accumilated user time */
-	apr_table_setn( 
-		last->notes,
-		notes_key_utime,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			time_difference(
-				last,
-				&(data->begin_own_usage.ru_utime),
-				&(end_own_usage.ru_utime)
-			)
-		)
-	);
-	
-	/* Set the accumilated system time */
-	apr_table_setn(
-		last->notes,
-		notes_key_stime,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			time_difference(
-				last,
-				&(data->begin_own_usage.ru_stime),
-				&(end_own_usage.ru_stime)
-			)
-		)
-	);
-	/* 	
-	apr_table_setn(
-		last->notes,
-		notes_key_stime,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			end_own_usage.ru_stime.tv_usec
-		)
-	); */
-	
-	/* Set the accumulated inblocks */
-	apr_table_setn( 
-		last->notes,
-		notes_key_inblock,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			block_difference(
-				last,
-				data->begin_own_usage.ru_inblock,
-				end_own_usage.ru_inblock
-			)
-		)
-	);
-	
-	/* Set the accumulated oublocks */
-	apr_table_setn( 
-		last->notes,
-		notes_key_oublock,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			block_difference(
-				last,
-				data->begin_own_usage.ru_oublock,
-				end_own_usage.ru_oublock
-			)
-		)
-	);
-	
-	/* Set the child accumilated user time */
-	apr_table_setn(
-		last->notes,
-		notes_key_cutime,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			time_difference(
-				last,
-				&(data->begin_child_usage.ru_utime),
-				&(end_child_usage.ru_utime)
-			)
-		)
-	);
-	
-	/* Set the child accumilated system time */
-	apr_table_setn(
-		last->notes,
-		notes_key_cstime,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			time_difference(
-				last,
-				&(data->begin_child_usage.ru_stime),
-				&(end_child_usage.ru_stime)
-			)
-		)
-	);
-	
-	/* Set the child accumulated inblocks */
-	apr_table_setn(
-		last->notes,
-		notes_key_cinblock,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			block_difference(
-				last,
-				data->begin_child_usage.ru_inblock,
-				end_child_usage.ru_inblock
-			)
-		)
-	);
-	
-	/* Set the child accumulated oublocks */
-	apr_table_setn(
-		last->notes,
-		notes_key_coublock,
-		apr_psprintf(
-			last->pool,
-			"%ld",
-			block_difference(
-				last,
-				data->begin_child_usage.ru_oublock,
-				end_child_usage.ru_oublock
-			)
-		)
-	);
+	selected[i] = 1;
+	conf->selected = selected;
 
-	/* We're not a final handler */
-    return DECLINED;
+	return NULL;
+} // }}}
+
+
+/* AccountingCPUSource auto|process|thread */
+static const char *set_cpu_source(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if (!strcasecmp(arg, "auto"))
+		conf->cpu_source = ACC_CPU_AUTO;
+	else if (!strcasecmp(arg, "process"))
+		conf->cpu_source = ACC_CPU_PROCESS;
+	else if (!strcasecmp(arg, "thread"))
+		conf->cpu_source = ACC_CPU_THREAD;
+	else
+		return "AccountingCPUSource must be one of auto, process or thread";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingClock realtime|monotonic|coarse|request */
+static const char *set_clock(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if (!strcasecmp(arg, "realtime"))
+		conf->clock = ACC_CLOCK_REALTIME;
+	else if (!strcasecmp(arg, "monotonic"))
+		conf->clock = ACC_CLOCK_MONOTONIC;
+	else if (!strcasecmp(arg, "coarse"))
+		conf->clock = ACC_CLOCK_COARSE;
+	else if (!strcasecmp(arg, "request"))
+		conf->clock = ACC_CLOCK_REQUEST;
+	else
+		return "AccountingClock must be one of realtime, monotonic, coarse or request";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingAnomalyInterval seconds */
+static const char *set_anomaly_interval(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if ((conf->anomaly_interval = atoi(arg)) < 0)
+		return "AccountingAnomalyInterval must not be negative";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingTrace On|Off */
+static const char *set_trace(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->trace = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingNotes On|Off */
+static const char *set_notes_flag(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->notes = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingReapChildren Off|Handler|Always */
+static const char *set_reap(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if (!strcasecmp(arg, "off"))
+		conf->reap = ACC_REAP_OFF;
+	else if (!strcasecmp(arg, "handler"))
+		conf->reap = ACC_REAP_HANDLER;
+	else if (!strcasecmp(arg, "always"))
+		conf->reap = ACC_REAP_ALWAYS;
+	else
+		return "AccountingReapChildren must be one of Off, Handler or Always";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingReapHandler handler [handler] ... */
+static const char *add_reap_handler(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if (conf->reap_handlers == NULL)
+		conf->reap_handlers = apr_array_make(cmd->pool, 2, sizeof(const char*));
+
+	APR_ARRAY_PUSH(conf->reap_handlers, const char*) = arg;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingConnectionSnapshot On|Off */
+static const char *set_conn_snapshot(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->conn_snapshot = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingLean On|Off */
+static const char *set_lean(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->lean = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingSampleRate N */
+static const char *set_sample_rate(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if ((conf->sample_rate = atoi(arg)) < 1)
+		return "AccountingSampleRate must be a positive number";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingSlowThreshold milliseconds */
+static const char *set_slow_threshold(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	int msec = atoi(arg);
+
+	if (msec < 0)
+		return "AccountingSlowThreshold must be a number of milliseconds";
+
+	conf->slow_threshold = (apr_int64_t) msec * 1000;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingPhases On|Off */
+static const char *set_phases(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->phases = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingBytes On|Off */
+static const char *set_bytes(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->bytes = flag;
+
+	return NULL;
 } // }}}
 
 
+/* AccountingThreadIO On|Off */
+static const char *set_thread_io(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->thread_io = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingMemory On|Off */
+static const char *set_memory(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+#ifndef ACC_POOL_BYTES
+	if (flag)
+		return "AccountingMemory needs APR pool debugging or glibc 2.33 or later";
+#endif
+
+	conf->memory = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingSubrequests N */
+static const char *set_subrequests(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->subrequests = atoi(arg);
+	if (conf->subrequests < 0 || conf->subrequests > 1000)
+		return "AccountingSubrequests must be between 0 and 1000";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingBackend On|Off */
+static const char *set_backend(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->backend = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingBackendHeader header */
+static const char *set_backend_header(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->backend_header = arg;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingCgroup directory */
+static const char *set_cgroup(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	conf->cgroup_root = arg;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingCpuBudget seconds window */
+static const char *set_budget(cmd_parms *cmd, void *dummy, const char *seconds, const char *window){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	int budget = atoi(seconds);
+	int length = atoi(window);
+
+	if (budget < 0)
+		return "AccountingCpuBudget needs a positive number of CPU seconds";
+
+	if (length < ACC_BUDGET_BUCKETS)
+		return apr_psprintf(cmd->pool, "AccountingCpuBudget needs a window of at least %d seconds", ACC_BUDGET_BUCKETS);
+
+	conf->budget = (apr_int64_t) budget * 1000000;
+	conf->budget_window = apr_time_from_sec(length);
+
+	return NULL;
+} // }}}
+
+
+/* AccountingCpuBudgetAction 503|429|delay [milliseconds] */
+static const char *set_budget_action(cmd_parms *cmd, void *dummy, const char *action, const char *delay){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if (!strcmp(action, "503"))
+		conf->budget_action = ACC_BUDGET_REJECT;
+	else if (!strcmp(action, "429"))
+		conf->budget_action = ACC_BUDGET_LIMIT;
+	else if (!strcasecmp(action, "delay"))
+		conf->budget_action = ACC_BUDGET_DELAY;
+	else
+		return "AccountingCpuBudgetAction must be 503, 429 or delay";
+
+	conf->budget_delay = apr_time_from_msec(delay ? atoi(delay) : 1000);
+
+	return NULL;
+} // }}}
+
+
+/* AccountingHistograms On|Off */
+static const char *set_histograms(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->histograms = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingExport host:port [seconds] */
+static const char *set_export(cmd_parms *cmd, void *dummy, const char *addr, const char *interval){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+	char *host, *scope;
+	apr_port_t port;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+#if !APR_HAS_THREADS
+	return "AccountingExport needs APR with thread support";
+#endif
+
+	if (apr_parse_addr_port(&host, &scope, &port, addr, cmd->pool) != APR_SUCCESS || host == NULL || !port)
+		return "AccountingExport needs a host:port";
+
+	conf->export_host = host;
+	conf->export_port = port;
+
+	if (interval)
+	{
+		if (atoi(interval) < 1)
+			return "AccountingExport needs an interval of at least a second";
+
+		conf->export_interval = apr_time_from_sec(atoi(interval));
+	}
+
+	return NULL;
+} // }}}
+
+
+/* AccountingExportPacket bytes */
+static const char *set_export_packet(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+	int size = atoi(arg);
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	if (size < 512 || size > 65507)
+		return "AccountingExportPacket must be between 512 and 65507 bytes";
+
+	conf->export_packet = size;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingHeavyHitters entries */
+static const char *set_hitters(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	if ((conf->hitters = atoi(arg)) < 0)
+		return "AccountingHeavyHitters must be a number of entries";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingAggregate On|Off */
+static const char *set_aggregate(cmd_parms *cmd, void *dummy, int flag){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	conf->aggregate = flag;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingKey vhost|user|none, or AccountingKey env|header name */
+static const char *set_key(cmd_parms *cmd, void *dummy, const char *source, const char *name){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+
+	if (!strcasecmp(source, "vhost"))
+		conf->key_source = ACC_KEY_VHOST;
+	else if (!strcasecmp(source, "user"))
+		conf->key_source = ACC_KEY_USER;
+	else if (!strcasecmp(source, "none"))
+		conf->key_source = ACC_KEY_NONE;
+	else if (!strcasecmp(source, "env"))
+		conf->key_source = ACC_KEY_ENV;
+	else if (!strcasecmp(source, "header"))
+		conf->key_source = ACC_KEY_HEADER;
+	else
+		return "AccountingKey must be vhost, user, none, env or header";
+
+	if ((conf->key_source == ACC_KEY_ENV || conf->key_source == ACC_KEY_HEADER) != (name != NULL))
+		return "AccountingKey needs a name with env and header, and only then";
+
+	conf->key_name = name;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingKeys entries */
+static const char *set_keys(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	conf->keys = atoi(arg);
+	if (conf->keys < 1 || conf->keys > 1 << 20)
+		return "AccountingKeys must be between 1 and 1048576 entries";
+
+	return NULL;
+} // }}}
+
+
+/* AccountingStateFile path */
+static const char *set_state_file(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	conf->state_file = arg;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingAggregatePrefix prefix [prefix] ... */
+static const char *add_aggregate_prefix(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	acc_prefix *prefix;
+
+	if (conf->prefixes == NULL)
+		conf->prefixes = apr_array_make(cmd->pool, 4, sizeof(acc_prefix));
+
+	prefix = apr_array_push(conf->prefixes);
+	prefix->prefix = arg;
+	prefix->len = strlen(arg);
+	prefix->slot = -1;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingLog file|"|program" */
+static const char *set_binlog(cmd_parms *cmd, void *dummy, const char *arg){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	conf->binlog_path = arg;
+
+	return NULL;
+} // }}}
+
+
+/* AccountingLogBuffer bytes [flush-seconds] */
+static const char *set_binlog_buffer(cmd_parms *cmd, void *dummy, const char *size, const char *interval){ // {{{
+	acc_server_conf *conf = ap_get_module_config(cmd->server->module_config, &accounting_module);
+	const char *err;
+	apr_int64_t bytes;
+
+	if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+		return err;
+
+	bytes = apr_atoi64(size);
+	if (bytes < 1024 || bytes > 16 * 1024 * 1024)
+		return "AccountingLogBuffer must be between 1024 and 16777216 bytes";
+
+	conf->binlog_buffer = bytes;
+
+	if (interval)
+	{
+		if (atoi(interval) < 0)
+			return "AccountingLogBuffer flush interval must not be negative";
+
+		conf->binlog_interval = apr_time_from_sec(atoi(interval));
+	}
+
+	return NULL;
+} // }}}
+
+
+static const command_rec accounting_cmds[] = { // {{{
+	AP_INIT_FLAG(
+		"Accounting",
+		set_enabled,
+		NULL,
+		RSRC_CONF | ACCESS_CONF,
+		"Account requests (default On)"
+	),
+	AP_INIT_ITERATE(
+		"AccountingMetrics",
+		add_metric,
+		NULL,
+		RSRC_CONF | ACCESS_CONF,
+		"Metrics to report in the notes and %{...}Z items, or \"all\""
+	),
+	AP_INIT_TAKE1(
+		"AccountingCPUSource",
+		set_cpu_source,
+		NULL,
+		RSRC_CONF,
+		"Where CPU time is taken from: auto (default), process or thread"
+	),
+	AP_INIT_TAKE1(
+		"AccountingClock",
+		set_clock,
+		NULL,
+		RSRC_CONF,
+		"Clock for the time of a request: realtime, monotonic (default), coarse or request"
+	),
+	AP_INIT_TAKE1(
+		"AccountingAnomalyInterval",
+		set_anomaly_interval,
+		NULL,
+		RSRC_CONF,
+		"Seconds between error log reports of measuring anomalies (default 60)"
+	),
+	AP_INIT_FLAG(
+		"AccountingTrace",
+		set_trace,
+		NULL,
+		RSRC_CONF,
+		"Log debug traces of the measured values (needs a build with ACC_TRACE)"
+	),
+	AP_INIT_FLAG(
+		"AccountingNotes",
+		set_notes_flag,
+		NULL,
+		RSRC_CONF,
+		"Store the results as ACC_* notes of the request (default On)"
+	),
+	AP_INIT_TAKE1(
+		"AccountingReapChildren",
+		set_reap,
+		NULL,
+		RSRC_CONF,
+		"When to reap terminated children: Off, Handler (default) or Always"
+	),
+	AP_INIT_ITERATE(
+		"AccountingReapHandler",
+		add_reap_handler,
+		NULL,
+		RSRC_CONF,
+		"Handlers after which children are reaped (default cgi-script)"
+	),
+	AP_INIT_FLAG(
+		"AccountingConnectionSnapshot",
+		set_conn_snapshot,
+		NULL,
+		RSRC_CONF,
+		"Take the usage at the end of a request as the begin of the next one on the connection (default Off)"
+	),
+	AP_INIT_FLAG(
+		"AccountingLean",
+		set_lean,
+		NULL,
+		RSRC_CONF,
+		"Only read the CPU clock, and the children's usage when children are expected (default Off)"
+	),
+	AP_INIT_TAKE1(
+		"AccountingSampleRate",
+		set_sample_rate,
+		NULL,
+		RSRC_CONF,
+		"Only measure one in this many requests in full"
+	),
+	AP_INIT_TAKE1(
+		"AccountingSlowThreshold",
+		set_slow_threshold,
+		NULL,
+		RSRC_CONF,
+		"Also report requests that aren't sampled after this many milliseconds"
+	),
+	AP_INIT_FLAG(
+		"AccountingPhases",
+		set_phases,
+		NULL,
+		RSRC_CONF,
+		"Also measure the time and CPU time of each phase of a request"
+	),
+	AP_INIT_FLAG(
+		"AccountingBytes",
+		set_bytes,
+		NULL,
+		RSRC_CONF,
+		"Also count the bytes of the request body and of the response, and the time to the first byte"
+	),
+	AP_INIT_FLAG(
+		"AccountingThreadIO",
+		set_thread_io,
+		NULL,
+		RSRC_CONF,
+		"Also measure the I/O of a request from /proc/thread-self/io"
+	),
+	AP_INIT_FLAG(
+		"AccountingMemory",
+		set_memory,
+		NULL,
+		RSRC_CONF,
+		"Also measure the memory allocated for a request"
+	),
+	AP_INIT_TAKE1(
+		"AccountingSubrequests",
+		set_subrequests,
+		NULL,
+		RSRC_CONF,
+		"Time up to this many subrequests of a request on their own (default 0, off)"
+	),
+	AP_INIT_FLAG(
+		"AccountingBackend",
+		set_backend,
+		NULL,
+		RSRC_CONF,
+		"Time the backends of proxied requests"
+	),
+	AP_INIT_TAKE1(
+		"AccountingBackendHeader",
+		set_backend_header,
+		NULL,
+		RSRC_CONF,
+		"Response header in which backends report their CPU time (implies AccountingBackend)"
+	),
+	AP_INIT_TAKE1(
+		"AccountingCgroup",
+		set_cgroup,
+		NULL,
+		RSRC_CONF,
+		"Delegated cgroup v2 directory in which every child gets a cgroup of its own"
+	),
+	AP_INIT_TAKE2(
+		"AccountingCpuBudget",
+		set_budget,
+		NULL,
+		RSRC_CONF,
+		"CPU seconds the requests of a server may use per window of this many seconds"
+	),
+	AP_INIT_TAKE12(
+		"AccountingCpuBudgetAction",
+		set_budget_action,
+		NULL,
+		RSRC_CONF,
+		"What to do with requests over the CPU budget: 503, 429 or delay (milliseconds)"
+	),
+	AP_INIT_FLAG(
+		"AccountingHistograms",
+		set_histograms,
+		NULL,
+		RSRC_CONF,
+		"Also keep histograms of the time and CPU time of requests, with AccountingAggregate"
+	),
+	AP_INIT_TAKE12(
+		"AccountingExport",
+		set_export,
+		NULL,
+		RSRC_CONF,
+		"statsd collector (host:port) to send the aggregated counters to, and the interval in seconds"
+	),
+	AP_INIT_TAKE1(
+		"AccountingExportPacket",
+		set_export_packet,
+		NULL,
+		RSRC_CONF,
+		"Largest UDP packet to send to the collector"
+	),
+	AP_INIT_TAKE1(
+		"AccountingHeavyHitters",
+		set_hitters,
+		NULL,
+		RSRC_CONF,
+		"Number of URIs and of clients to track the CPU time of"
+	),
+	AP_INIT_FLAG(
+		"AccountingAggregate",
+		set_aggregate,
+		NULL,
+		RSRC_CONF,
+		"Add the usage of every request to per server totals in shared memory"
+	),
+	AP_INIT_ITERATE(
+		"AccountingAggregatePrefix",
+		add_aggregate_prefix,
+		NULL,
+		RSRC_CONF,
+		"URI prefixes that get totals of their own"
+	),
+	AP_INIT_TAKE12(
+		"AccountingKey",
+		set_key,
+		NULL,
+		RSRC_CONF,
+		"What else to count requests by: vhost, user, env <variable>, header <name> or none"
+	),
+	AP_INIT_TAKE1(
+		"AccountingKeys",
+		set_keys,
+		NULL,
+		RSRC_CONF,
+		"Number of distinct AccountingKey values to keep counters for"
+	),
+	AP_INIT_TAKE1(
+		"AccountingStateFile",
+		set_state_file,
+		NULL,
+		RSRC_CONF,
+		"File to keep the aggregated counters in across restarts"
+	),
+	AP_INIT_TAKE1(
+		"AccountingLog",
+		set_binlog,
+		NULL,
+		RSRC_CONF,
+		"File or |program to write binary accounting records to"
+	),
+	AP_INIT_TAKE12(
+		"AccountingLogBuffer",
+		set_binlog_buffer,
+		NULL,
+		RSRC_CONF,
+		"Size of the per child AccountingLog buffer, and seconds between flushes"
+	),
+	{ NULL }
+}; // }}}
+
+
 static void register_hooks(apr_pool_t *p){ // {{{
    ap_hook_post_read_request(module_accounting_start, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_create_request(module_accounting_create_request, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_post_read_request(module_accounting_budget, NULL, NULL, APR_HOOK_LAST);
    ap_hook_log_transaction(module_accounting_stop, NULL, NULL, APR_HOOK_FIRST);
+   ap_hook_pre_config(module_accounting_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_translate_name(module_accounting_translate, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   ap_hook_map_to_storage(module_accounting_map, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   ap_hook_access_checker(module_accounting_access, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   ap_hook_fixups(module_accounting_fixups, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   ap_hook_fixups(module_accounting_key, NULL, NULL, APR_HOOK_REALLY_LAST);
+   ap_hook_insert_filter(module_accounting_insert_filter, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_handler(module_accounting_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   ap_hook_handler(module_accounting_status, NULL, NULL, APR_HOOK_MIDDLE);
+   APR_OPTIONAL_HOOK(proxy, pre_request, module_accounting_proxy_pre, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   APR_OPTIONAL_HOOK(proxy, post_request, module_accounting_proxy_post, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   APR_REGISTER_OPTIONAL_FN(acc_get_value);
+
+   /* Sorts before all resource filters, to see the first output */
+   first_output_filter_handle = ap_register_output_filter(
+      "ACCOUNTING_FIRST_OUTPUT",
+      first_output_filter,
+      NULL,
+      (ap_filter_type) (AP_FTYPE_RESOURCE - 1)
+   );
+   bytes_in_filter_handle = ap_register_input_filter(
+      "ACCOUNTING_BYTES_IN",
+      bytes_in_filter,
+      NULL,
+      AP_FTYPE_RESOURCE
+   );
+   /* After the protocol filters, but still per request */
+   bytes_out_filter_handle = ap_register_output_filter(
+      "ACCOUNTING_BYTES_OUT",
+      bytes_out_filter,
+      NULL,
+      AP_FTYPE_TRANSCODE
+   );
+   APR_REGISTER_OPTIONAL_FN(acc_note_child);
+   ap_hook_open_logs(module_accounting_open_logs, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_post_config(module_accounting_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_child_init(module_accounting_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 } // }}}
 
 
 module AP_MODULE_DECLARE_DATA accounting_module = { // {{{
     STANDARD20_MODULE_STUFF,
-    NULL,                       /* create per-dir config */
-    NULL,                       /* merge per-dir config */
-    NULL,                       /* server config */
-    NULL,                       /* merge server config */
-    NULL,                       /* command table */
+    create_dir_config,          /* create per-dir config */
+    merge_dir_config,           /* merge per-dir config */
+    create_server_config,       /* server config */
+    merge_server_config,        /* merge server config */
+    accounting_cmds,            /* command table */
     register_hooks
 }; // }}}
 
@@ -0,0 +1,36 @@
+#ifndef MOD_ACCOUNTING_H
+#define MOD_ACCOUNTING_H
+
+#include "httpd.h"
+#include "apr_optional.h"
+
+/* Get a measured value of a request
+ *
+ * The name is the one used by the %{name}Z log format item, e.g. "utime".
+ * Times are in microseconds, block counts in blocks. The values are
+ * available from the log_transaction phase on, as mod_accounting fills
+ * them in with APR_HOOK_FIRST.
+ *
+ * Returns OK and sets *value, or DECLINED when the request wasn't accounted
+ * or the name is unknown.
+ *
+ * Retrieve it with APR_RETRIEVE_OPTIONAL_FN(acc_get_value).
+ */
+APR_DECLARE_OPTIONAL_FN(int, acc_get_value, (const request_rec *r, const char *name, apr_int64_t *value));
+
+/* Register a child process spawned for a request
+ *
+ * mod_accounting reaps the child with waitpid() once it has terminated,
+ * before measuring the usage of the children at the end of the request,
+ * so its usage is included in cutime and cstime. The caller gives up the
+ * exit status of the child unless it waits for it before logging.
+ *
+ * Nothing in httpd itself calls it: a module that spawns children for a
+ * request has to, or its handler has to be an AccountingReapHandler, after
+ * which mod_accounting reaps any terminated child (as for mod_cgi).
+ *
+ * Retrieve it with APR_RETRIEVE_OPTIONAL_FN(acc_note_child).
+ */
+APR_DECLARE_OPTIONAL_FN(void, acc_note_child, (const request_rec *r, pid_t pid));
+
+#endif /* MOD_ACCOUNTING_H */
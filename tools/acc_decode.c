@@ -0,0 +1,246 @@
+/* Decoder for the binary AccountingLog of mod_accounting
+ *
+ * Usage: acc_decode [file ...]
+ *
+ * Reads the log from the files, or from stdin without arguments, and
+ * prints a line per request:
+ *
+ *   <date> <time> <server> <status> <bytes> <metric>=<value> ...
+ *
+ * and a line per child that exited, CPU times in microseconds:
+ *
+ *   <date> <time> child <pid> <seconds> <requests> utime=<value> ...
+ *
+ * The log has to be decoded on a host with the same byte order as the
+ * one that wrote it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "../acc_binlog.h"
+
+/* Names of the servers seen so far */
+typedef struct server {
+	uint32_t       id;
+	char          *name;
+	struct server *next;
+} server;
+
+static server *servers = NULL;
+
+/* Names of the metrics, as announced by the last metrics record */
+static char   **metric_names = NULL;
+static uint32_t metric_count = 0;
+
+static const char *server_name(uint32_t id){
+	server *s;
+
+	for (s = servers; s; s = s->next)
+	{
+		if (s->id == id)
+			return s->name;
+	}
+
+	return "-";
+}
+
+static void add_server(const acc_binlog_server *rec){
+	server *s;
+	const char *name = (const char*) (rec + 1);
+
+	if (rec->length == 0 || sizeof(*rec) + rec->length > rec->header.size)
+		return;
+
+	for (s = servers; s; s = s->next)
+	{
+		if (s->id == rec->id)
+			break;
+	}
+
+	if (s == NULL)
+	{
+		if ((s = malloc(sizeof(*s))) == NULL)
+			return;
+
+		s->id = rec->id;
+		s->next = servers;
+		servers = s;
+	}
+	else
+		free(s->name);
+
+	s->name = strndup(name, rec->length - 1);
+}
+
+static void set_metrics(const acc_binlog_metrics *rec){
+	const char *c = (const char*) (rec + 1);
+	const char *end = c + rec->length;
+	uint32_t i;
+
+	if (sizeof(*rec) + rec->length > rec->header.size)
+		return;
+
+	for (i = 0; i < metric_count; i++)
+		free(metric_names[i]);
+	free(metric_names);
+
+	metric_count = 0;
+	if ((metric_names = calloc(rec->count, sizeof(char*))) == NULL)
+		return;
+
+	for (i = 0; i < rec->count && c < end; i++)
+	{
+		metric_names[i] = strndup(c, end - c);
+		c += strlen(metric_names[i]) + 1;
+	}
+
+	metric_count = i;
+}
+
+static void print_request(const acc_binlog_request *rec){
+	const int64_t *value = (const int64_t*) (rec + 1);
+	time_t sec = rec->timestamp / 1000000;
+	char date[32];
+	uint16_t i;
+
+	if (sizeof(*rec) + rec->values * sizeof(int64_t) > rec->header.size)
+		return;
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+
+	printf(
+		"%s.%06u %s %u %" PRIu64,
+		date,
+		(unsigned) (rec->timestamp % 1000000),
+		server_name(rec->server),
+		(unsigned) rec->status,
+		rec->bytes
+	);
+
+	for (i = 0; i < rec->values; i++)
+	{
+		if (i < metric_count)
+			printf(" %s=%" PRId64, metric_names[i], value[i]);
+		else
+			printf(" %u=%" PRId64, (unsigned) i, value[i]);
+	}
+
+	putchar('\n');
+}
+
+static void print_child(const acc_binlog_child *rec){
+	time_t sec = rec->timestamp / 1000000;
+	char date[32];
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+
+	printf(
+		"%s.%06u child %u %" PRIu64 " %" PRIu64
+		" utime=%" PRId64 " stime=%" PRId64 " cutime=%" PRId64 " cstime=%" PRId64
+		" request_utime=%" PRId64 " request_stime=%" PRId64
+		" request_cutime=%" PRId64 " request_cstime=%" PRId64
+		" maxrss=%" PRId64 "\n",
+		date,
+		(unsigned) (rec->timestamp % 1000000),
+		(unsigned) rec->pid,
+		(rec->timestamp - rec->started) / 1000000,
+		rec->requests,
+		rec->utime,
+		rec->stime,
+		rec->cutime,
+		rec->cstime,
+		rec->request_utime,
+		rec->request_stime,
+		rec->request_cutime,
+		rec->request_cstime,
+		rec->maxrss
+	);
+}
+
+static int decode(FILE *in, const char *fname){
+	acc_binlog_header header;
+	char *rec = NULL;
+	size_t size = 0;
+
+	while (fread(&header, sizeof(header), 1, in) == 1)
+	{
+		if (header.magic != ACC_BINLOG_MAGIC || header.size < sizeof(header) || header.size % 8)
+		{
+			fprintf(stderr, "%s: not an accounting log, or corrupt\n", fname);
+			free(rec);
+			return 1;
+		}
+
+		if (header.size > size)
+		{
+			free(rec);
+			size = header.size;
+			if ((rec = malloc(size)) == NULL)
+			{
+				perror("malloc");
+				return 1;
+			}
+		}
+
+		memcpy(rec, &header, sizeof(header));
+		if (fread(rec + sizeof(header), header.size - sizeof(header), 1, in) != 1 && header.size > sizeof(header))
+		{
+			fprintf(stderr, "%s: truncated record\n", fname);
+			free(rec);
+			return 1;
+		}
+
+		/* Skip records of newer versions we don't understand */
+		if (header.version != ACC_BINLOG_VERSION)
+			continue;
+
+		switch (header.type)
+		{
+			case ACC_BINLOG_METRICS:
+				if (header.size >= sizeof(acc_binlog_metrics))
+					set_metrics((const acc_binlog_metrics*) rec);
+				break;
+			case ACC_BINLOG_SERVER:
+				if (header.size >= sizeof(acc_binlog_server))
+					add_server((const acc_binlog_server*) rec);
+				break;
+			case ACC_BINLOG_REQUEST:
+				if (header.size >= sizeof(acc_binlog_request))
+					print_request((const acc_binlog_request*) rec);
+				break;
+			case ACC_BINLOG_CHILD:
+				if (header.size >= sizeof(acc_binlog_child))
+					print_child((const acc_binlog_child*) rec);
+				break;
+		}
+	}
+
+	free(rec);
+	return ferror(in) ? 1 : 0;
+}
+
+int main(int argc, char **argv){
+	int i, rv = 0;
+	FILE *in;
+
+	if (argc < 2)
+		return decode(stdin, "stdin");
+
+	for (i = 1; i < argc; i++)
+	{
+		if ((in = fopen(argv[i], "rb")) == NULL)
+		{
+			perror(argv[i]);
+			rv = 1;
+			continue;
+		}
+
+		rv |= decode(in, argv[i]);
+		fclose(in);
+	}
+
+	return rv;
+}